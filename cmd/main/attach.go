@@ -0,0 +1,500 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"log"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+
+	"github.com/cilium/ebpf"
+	"github.com/cilium/ebpf/link"
+	"github.com/vishvananda/netlink"
+	"golang.org/x/sys/unix"
+)
+
+// attachMode 选择把程序挂到网卡 egress 的方式
+type attachMode string
+
+const (
+	// attachModeAuto 优先使用 TCX，内核不支持时回退到 netlink clsact
+	attachModeAuto attachMode = "auto"
+	// attachModeTCX 使用 bpf_link 形式的 TCX 挂载 (内核 6.6+)
+	attachModeTCX attachMode = "tcx"
+	// attachModeTC 使用 netlink 创建 clsact qdisc 和 direct-action bpf filter
+	attachModeTC attachMode = "tc"
+	// attachModeCgroup 是 sockops 引擎挂在 cgroup 上的方式，不能通过 -attach-mode 选择
+	attachModeCgroup attachMode = "cgroup"
+	// attachModeXDP 是 XDP 引擎挂在网卡 ingress 上的方式，同样由引擎决定
+	attachModeXDP attachMode = "xdp"
+	// attachModeLWT 是 LWT 引擎挂在路由上的方式
+	attachModeLWT attachMode = "lwt"
+)
+
+func parseAttachMode(s string) (attachMode, error) {
+	switch m := attachMode(s); m {
+	case attachModeAuto, attachModeTCX, attachModeTC:
+		return m, nil
+	}
+	return "", fmt.Errorf("unknown attach mode %q (want auto, tcx or tc)", s)
+}
+
+// filterName/filterPrio/filterHandle 标识我们在 clsact 上创建的 filter，
+// 只删除自己的 filter，不影响同一网卡上其他组件的 tc 规则
+const (
+	filterName   = "inject_tcp_option"
+	filterPrio   = 1
+	filterHandle = 1
+)
+
+// attachment 表示程序在某个网卡上的一次挂载
+type attachment interface {
+	// Mode 返回实际使用的挂载方式
+	Mode() attachMode
+	// Detach 从网卡上卸载程序，并删除对应的固定文件
+	Detach() error
+	// Release 只释放进程持有的句柄，程序继续留在网卡上，供下一个进程接管
+	Release() error
+}
+
+// attacher 在进程内完成挂载，不再 fork tc 命令
+type attacher struct {
+	prog *ebpf.Program
+	// pinDir 不为空时，TCX link 固定在 pinDir 下，重启后用 link.Update 原子替换程序
+	pinDir string
+	// txPorts 是 XDP 引擎的重定向目标表，挂载了程序的网卡才能作为 bpf_redirect_map 的出口
+	txPorts *ebpf.Map
+	// ingress 把 TC 程序挂到网卡的 ingress 而不是 egress (tc-ingress 引擎)
+	ingress bool
+
+	mu   sync.Mutex
+	mode attachMode
+}
+
+func newAttacher(prog *ebpf.Program, mode attachMode, pinDir string) *attacher {
+	return &attacher{prog: prog, mode: mode, pinDir: pinDir}
+}
+
+// attach 把程序挂到 ifindex 对应网卡的 egress (或 ingress)
+func (a *attacher) attach(ifindex int) (attachment, error) {
+	a.mu.Lock()
+	mode := a.mode
+	a.mu.Unlock()
+
+	prog, release := a.program()
+	defer release()
+
+	switch mode {
+	case attachModeTC:
+		return attachNetlink(prog, ifindex, a.ingress)
+	case attachModeXDP:
+		return attachXDP(prog, ifindex, a.linkPin(ifindex), a.txPorts)
+	}
+
+	att, err := attachTCX(prog, ifindex, a.linkPin(ifindex), tcxAttachType(a.ingress))
+	if err == nil || mode == attachModeTCX || !errors.Is(err, ebpf.ErrNotSupported) {
+		return att, err
+	}
+
+	// 内核不支持 TCX，之后的网卡直接走 netlink，避免每次都探测一遍
+	a.mu.Lock()
+	if a.mode == attachModeAuto {
+		log.Printf("TCX is not supported by this kernel, falling back to clsact filters")
+		a.mode = attachModeTC
+	}
+	a.mu.Unlock()
+	return attachNetlink(prog, ifindex, a.ingress)
+}
+
+// program 返回要挂载的程序。固定了程序时使用 pinDir 中的当前版本，
+// upgrade 替换程序之后新出现的网卡也会挂载新版本。
+// 挂载完成后 link/filter 持有程序引用，调用方通过 release 关闭临时打开的句柄
+func (a *attacher) program() (*ebpf.Program, func()) {
+	if a.pinDir != "" {
+		name := tcProgramPin
+		switch {
+		case a.mode == attachModeXDP:
+			name = xdpProgramPin
+		case a.ingress:
+			name = ingressProgramPin
+		}
+		if p, err := ebpf.LoadPinnedProgram(filepath.Join(a.pinDir, name), nil); err == nil {
+			return p, func() { p.Close() }
+		}
+	}
+	return a.prog, func() {}
+}
+
+// tcxPinPrefix/tcxIngressPinPrefix/xdpPinPrefix 是 TCX egress、TCX ingress 和 XDP link 固定文件名的前缀，
+// 后缀为 ifindex
+const (
+	tcxPinPrefix        = "tcx_egress_"
+	tcxIngressPinPrefix = "tcx_ingress_"
+	xdpPinPrefix        = "xdp_"
+)
+
+// pinPrefix 返回当前挂载方式的 link 固定文件名前缀
+func (a *attacher) pinPrefix() string {
+	switch {
+	case a.mode == attachModeXDP:
+		return xdpPinPrefix
+	case a.ingress:
+		return tcxIngressPinPrefix
+	}
+	return tcxPinPrefix
+}
+
+// tcxAttachType 返回 TCX 挂载点
+func tcxAttachType(ingress bool) ebpf.AttachType {
+	if ingress {
+		return ebpf.AttachTCXIngress
+	}
+	return ebpf.AttachTCXEgress
+}
+
+func (a *attacher) linkPin(ifindex int) string {
+	if a.pinDir == "" {
+		return ""
+	}
+	return filepath.Join(a.pinDir, a.pinPrefix()+strconv.Itoa(ifindex))
+}
+
+// removeStalePins 卸载上一个进程留下的、不在 keep 中的 TCX (或 XDP) link，
+// 例如不再符合选择规则的网卡
+func (a *attacher) removeStalePins(keep map[int]bool) {
+	if a.pinDir == "" {
+		return
+	}
+	entries, err := os.ReadDir(a.pinDir)
+	if err != nil {
+		return
+	}
+	prefix := a.pinPrefix()
+	for _, e := range entries {
+		ifindex, err := strconv.Atoi(strings.TrimPrefix(e.Name(), prefix))
+		if !strings.HasPrefix(e.Name(), prefix) || err != nil || keep[ifindex] {
+			continue
+		}
+		// 删除固定文件后 link 没有其他引用，内核随即把程序从网卡上卸下
+		path := filepath.Join(a.pinDir, e.Name())
+		if err := os.Remove(path); err != nil {
+			log.Printf("Failed to remove stale link pin %s: %v", path, err)
+			continue
+		}
+		log.Printf("Removed stale %s link for ifindex %d", a.mode, ifindex)
+	}
+}
+
+type tcxAttachment struct {
+	link link.Link
+	pin  string
+}
+
+// attachTCX 挂载 TCX link。pin 处已有上一个进程固定的、仍挂在同一网卡上的 link 时，
+// 直接用 Update 原子替换其中的程序，期间不会有报文漏过
+func attachTCX(prog *ebpf.Program, ifindex int, pin string, typ ebpf.AttachType) (*tcxAttachment, error) {
+	if pin != "" {
+		if l := adoptTCX(pin, ifindex, typ); l != nil {
+			if err := l.Update(prog); err == nil {
+				return &tcxAttachment{link: l, pin: pin}, nil
+			}
+			l.Close()
+		}
+		// 固定文件已失效 (网卡被删除后 ifindex 被复用等)，重新挂载
+		os.Remove(pin)
+	}
+
+	l, err := link.AttachTCX(link.TCXOptions{
+		Interface: ifindex,
+		Program:   prog,
+		Attach:    typ,
+	})
+	if err != nil {
+		return nil, fmt.Errorf("attach tcx: %w", err)
+	}
+	if pin != "" {
+		if err := l.Pin(pin); err != nil {
+			l.Close()
+			return nil, fmt.Errorf("pin tcx link: %w", err)
+		}
+	}
+	return &tcxAttachment{link: l, pin: pin}, nil
+}
+
+// adoptTCX 打开 pin 处固定的 link，只有它仍以 typ 挂在 ifindex 上时才返回
+func adoptTCX(pin string, ifindex int, typ ebpf.AttachType) link.Link {
+	l, err := link.LoadPinnedLink(pin, nil)
+	if err != nil {
+		return nil
+	}
+	info, err := l.Info()
+	if err != nil || info.TCX() == nil || int(info.TCX().Ifindex) != ifindex || ebpf.AttachType(info.TCX().AttachType) != typ {
+		l.Close()
+		return nil
+	}
+	return l
+}
+
+func (t *tcxAttachment) Mode() attachMode { return attachModeTCX }
+
+func (t *tcxAttachment) Detach() error {
+	if t.pin != "" {
+		if err := t.link.Unpin(); err != nil {
+			return err
+		}
+	}
+	return t.link.Close()
+}
+
+func (t *tcxAttachment) Release() error {
+	if t.pin == "" {
+		// 没有固定的 link 在句柄关闭时就会被卸载
+		return t.Detach()
+	}
+	return t.link.Close()
+}
+
+type xdpAttachment struct {
+	link    link.Link
+	pin     string
+	ifindex int
+	txPorts *ebpf.Map
+}
+
+// attachXDP 把程序挂到网卡的 XDP 入口，驱动支持时使用 native 模式，否则内核退回 generic 模式。
+// 与 TCX 一样，pin 处仍挂在同一网卡上的 link 用 Update 原子替换。
+// 挂载后把网卡加入 txPorts，其他网卡上的程序才会把报文重定向到这里
+func attachXDP(prog *ebpf.Program, ifindex int, pin string, txPorts *ebpf.Map) (*xdpAttachment, error) {
+	var l link.Link
+	if pin != "" {
+		if l = adoptXDP(pin, ifindex); l != nil {
+			if err := l.Update(prog); err != nil {
+				l.Close()
+				l = nil
+			}
+		}
+		if l == nil {
+			os.Remove(pin)
+		}
+	}
+
+	if l == nil {
+		var err error
+		l, err = link.AttachXDP(link.XDPOptions{
+			Program:   prog,
+			Interface: ifindex,
+		})
+		if err != nil {
+			return nil, fmt.Errorf("attach xdp: %w", err)
+		}
+		if pin != "" {
+			if err := l.Pin(pin); err != nil {
+				l.Close()
+				return nil, fmt.Errorf("pin xdp link: %w", err)
+			}
+		}
+	}
+
+	x := &xdpAttachment{link: l, pin: pin, ifindex: ifindex, txPorts: txPorts}
+	if txPorts != nil {
+		if err := txPorts.Put(uint32(ifindex), uint32(ifindex)); err != nil {
+			x.Detach()
+			return nil, fmt.Errorf("add ifindex %d to tx_ports: %w", ifindex, err)
+		}
+	}
+	return x, nil
+}
+
+// adoptXDP 打开 pin 处固定的 link，只有它仍挂在 ifindex 上时才返回
+func adoptXDP(pin string, ifindex int) link.Link {
+	l, err := link.LoadPinnedLink(pin, nil)
+	if err != nil {
+		return nil
+	}
+	info, err := l.Info()
+	if err != nil || info.XDP() == nil || int(info.XDP().Ifindex) != ifindex {
+		l.Close()
+		return nil
+	}
+	return l
+}
+
+func (x *xdpAttachment) Mode() attachMode { return attachModeXDP }
+
+func (x *xdpAttachment) Detach() error {
+	if x.txPorts != nil {
+		// 网卡已经消失时内核会自动删除表项
+		if err := x.txPorts.Delete(uint32(x.ifindex)); err != nil && !errors.Is(err, ebpf.ErrKeyNotExist) {
+			log.Printf("Failed to remove ifindex %d from tx_ports: %v", x.ifindex, err)
+		}
+	}
+	if x.pin != "" {
+		if err := x.link.Unpin(); err != nil {
+			return err
+		}
+	}
+	return x.link.Close()
+}
+
+// Release 保留 tx_ports 中的表项，下一个进程接管前重定向不会中断
+func (x *xdpAttachment) Release() error {
+	if x.pin == "" {
+		return x.Detach()
+	}
+	return x.link.Close()
+}
+
+type netlinkAttachment struct {
+	filter *netlink.BpfFilter
+}
+
+// clsactQdisc 返回网卡上的 clsact qdisc，它是挂载 TC BPF 程序的先决条件
+func clsactQdisc(ifindex int) *netlink.GenericQdisc {
+	return &netlink.GenericQdisc{
+		QdiscAttrs: netlink.QdiscAttrs{
+			LinkIndex: ifindex,
+			Handle:    netlink.MakeHandle(0xffff, 0),
+			Parent:    netlink.HANDLE_CLSACT,
+		},
+		QdiscType: "clsact",
+	}
+}
+
+// filterParent 返回 clsact 上 egress 或 ingress 的 filter 挂载点
+func filterParent(ingress bool) uint32 {
+	if ingress {
+		return netlink.HANDLE_MIN_INGRESS
+	}
+	return netlink.HANDLE_MIN_EGRESS
+}
+
+func bpfFilter(ifindex int, prog *ebpf.Program, ingress bool) *netlink.BpfFilter {
+	return &netlink.BpfFilter{
+		FilterAttrs: netlink.FilterAttrs{
+			LinkIndex: ifindex,
+			Parent:    filterParent(ingress),
+			Handle:    netlink.MakeHandle(0, filterHandle),
+			Protocol:  unix.ETH_P_ALL,
+			Priority:  filterPrio,
+		},
+		Fd:           prog.FD(),
+		Name:         filterName,
+		DirectAction: true,
+	}
+}
+
+// attachNetlink 挂载 clsact filter。filter 由内核持有程序引用，不需要固定；
+// 上一个进程留下的同 prio/handle 的 filter 会被 FilterReplace 原子替换
+func attachNetlink(prog *ebpf.Program, ifindex int, ingress bool) (*netlinkAttachment, error) {
+	// replace 在 clsact 已存在时不会清掉其他组件的 filter
+	if err := netlink.QdiscReplace(clsactQdisc(ifindex)); err != nil {
+		return nil, fmt.Errorf("add clsact qdisc: %w", err)
+	}
+	filter := bpfFilter(ifindex, prog, ingress)
+	if err := netlink.FilterReplace(filter); err != nil {
+		return nil, fmt.Errorf("add bpf filter: %w", err)
+	}
+	return &netlinkAttachment{filter: filter}, nil
+}
+
+func (n *netlinkAttachment) Mode() attachMode { return attachModeTC }
+
+func (n *netlinkAttachment) Detach() error { return netlink.FilterDel(n.filter) }
+
+func (n *netlinkAttachment) Release() error { return nil }
+
+type cgroupAttachment struct {
+	link link.Link
+	pin  string
+}
+
+// attachCgroup 把 sockops 程序挂到 path 对应的 cgroup (v2)，对其中所有进程的新连接生效。
+// pinDir 中已有上一个进程固定的 link 时，用 Update 原子替换程序
+func attachCgroup(prog *ebpf.Program, path, pinDir string) (*cgroupAttachment, error) {
+	return attachCgroupHook(prog, path, ebpf.AttachCGroupSockOps, pinDir, cgroupLinkPin)
+}
+
+// attachCgroupHook 以 typ 把程序挂到 cgroup，link 固定为 pinDir/pinName。
+// 同一个 cgroup 上的多个钩子各用一个固定文件
+func attachCgroupHook(prog *ebpf.Program, path string, typ ebpf.AttachType, pinDir, pinName string) (*cgroupAttachment, error) {
+	var pin string
+	if pinDir != "" {
+		pin = filepath.Join(pinDir, pinName)
+		if l := adoptCgroup(pin, path, typ); l != nil {
+			if err := l.Update(prog); err == nil {
+				return &cgroupAttachment{link: l, pin: pin}, nil
+			}
+			l.Close()
+		} else if _, err := os.Stat(pin); err == nil {
+			log.Printf("Pinned link %s is not attached to %s, re-attaching", pinName, path)
+		}
+		// 删除固定文件后，挂在其他 cgroup 上的旧 link 随之卸载
+		os.Remove(pin)
+	}
+
+	l, err := link.AttachCgroup(link.CgroupOptions{
+		Path:    path,
+		Attach:  typ,
+		Program: prog,
+	})
+	if err != nil {
+		return nil, fmt.Errorf("attach %s to cgroup %s: %w", pinName, path, err)
+	}
+	if pin != "" {
+		if err := l.Pin(pin); err != nil {
+			l.Close()
+			return nil, fmt.Errorf("pin cgroup link: %w", err)
+		}
+	}
+	return &cgroupAttachment{link: l, pin: pin}, nil
+}
+
+// adoptCgroup 打开 pin 处固定的 cgroup link，只有它以 typ 挂在 path 对应的 cgroup 上时才返回。
+// -cgroup 换了目录后，上一个进程固定的 link 还挂在旧的 cgroup 上，不能直接替换程序
+func adoptCgroup(pin, path string, typ ebpf.AttachType) link.Link {
+	l, err := link.LoadPinnedLink(pin, nil)
+	if err != nil {
+		return nil
+	}
+	id, err := cgroupID(path)
+	if err != nil {
+		l.Close()
+		return nil
+	}
+	info, err := l.Info()
+	if err != nil || info.Cgroup() == nil || info.Cgroup().CgroupId != id || ebpf.AttachType(info.Cgroup().AttachType) != typ {
+		l.Close()
+		return nil
+	}
+	return l
+}
+
+// cgroupID 返回 cgroup v2 目录的 ID，即 cgroupfs 中目录的 inode 号
+func cgroupID(path string) (uint64, error) {
+	var st unix.Stat_t
+	if err := unix.Stat(path, &st); err != nil {
+		return 0, fmt.Errorf("stat cgroup %s: %w", path, err)
+	}
+	return st.Ino, nil
+}
+
+func (c *cgroupAttachment) Mode() attachMode { return attachModeCgroup }
+
+func (c *cgroupAttachment) Detach() error {
+	if c.pin != "" {
+		if err := c.link.Unpin(); err != nil {
+			return err
+		}
+	}
+	return c.link.Close()
+}
+
+func (c *cgroupAttachment) Release() error {
+	if c.pin == "" {
+		return c.Detach()
+	}
+	return c.link.Close()
+}
@@ -0,0 +1,820 @@
+package main
+
+import (
+	"bytes"
+	"flag"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/cilium/ebpf"
+	"github.com/cilium/ebpf/rlimit"
+	"github.com/vishvananda/netlink"
+	"golang.org/x/sys/unix"
+)
+
+// benchIfacePrefix 是 attach 测试创建的 dummy 网卡名前缀，测试结束后全部删除
+const benchIfacePrefix = "injbench"
+
+// runBench 是 `ebpf-injector bench` 子命令的入口，需要 root 权限
+func runBench(args []string) {
+	fs := flag.NewFlagSet("bench", flag.ExitOnError)
+	suites := fs.String("suites", "prog,attach", "comma separated benchmark suites to run: prog, attach, policy, connect, conntrack, xdp, forward, lwt")
+	repeat := fs.Int("repeat", 100000, "PROG_TEST_RUN iterations per frame for the prog suite")
+	attachCounts := fs.String("attach-counts", "1,100,1000", "numbers of dummy interfaces for the attach suite")
+	attachModes := fs.String("attach-modes", "tcx,tc", "attach modes compared by the attach suite")
+	policyCounts := fs.String("policy-counts", "10,10000,1000000", "numbers of prefixes loaded by the policy suite")
+	connects := fs.Int("connects", 5000, "loopback connections per engine for the connect suite")
+	cgroupPath := fs.String("cgroup", "/sys/fs/cgroup", "cgroup the connect suite attaches the sockops engine to")
+	vethFrames := fs.Int("veth-frames", 1000000, "frames the xdp and forward suites send through a veth pair")
+	var cfg datapathConfig
+	cfg.registerFlags(fs)
+	fs.Parse(args)
+	// 测试加载的程序和 map 都是临时的，不能与守护进程的固定对象混用
+	cfg.pinDir = ""
+
+	if err := rlimit.RemoveMemlock(); err != nil {
+		log.Fatalf("Failed to remove memlock limit: %v", err)
+	}
+
+	// prog/attach/policy 测试的都是 TC 程序，connect 测试自己按引擎加载
+	tcCfg := cfg
+	tcCfg.engine = engineTC
+	objs := bpfObjects{}
+	if err := loadDatapath(tcCfg, &objs); err != nil {
+		log.Fatalf("Failed to load eBPF objects: %v", err)
+	}
+	defer objs.Close()
+
+	for _, suite := range strings.Split(*suites, ",") {
+		var err error
+		switch suite {
+		case "prog":
+			err = benchProgCsum(objs.InjectTcpOption, tcCfg, *repeat)
+		case "attach":
+			err = benchAttach(objs.InjectTcpOption, *attachModes, *attachCounts)
+		case "policy":
+			err = benchPolicy(tcCfg, *policyCounts, *repeat)
+		case "connect":
+			err = benchConnect(cfg, *connects, *cgroupPath)
+		case "conntrack":
+			err = benchConntrack(tcCfg, *repeat)
+		case "xdp":
+			err = benchXDP(cfg, *repeat, *vethFrames)
+		case "forward":
+			err = benchForward(cfg, *repeat, *vethFrames)
+		case "lwt":
+			err = benchLWT(cfg, *repeat)
+		default:
+			err = fmt.Errorf("unknown suite %q", suite)
+		}
+		if err != nil {
+			log.Fatalf("Benchmark suite %s failed: %v", suite, err)
+		}
+	}
+}
+
+func parseCounts(s string) ([]int, error) {
+	var counts []int
+	for _, f := range strings.Split(s, ",") {
+		n, err := strconv.Atoi(strings.TrimSpace(f))
+		if err != nil || n <= 0 {
+			return nil, fmt.Errorf("invalid count %q", f)
+		}
+		counts = append(counts, n)
+	}
+	return counts, nil
+}
+
+// progBenchFrame 是 prog 测试使用的一个报文，inject 表示程序应当注入 TOA 选项，
+// 否则输出必须与输入完全相同
+type progBenchFrame struct {
+	name   string
+	frame  []byte
+	inject bool
+}
+
+func benchSYN(tcpOptions []byte) tcpSegment {
+	return tcpSegment{
+		src: net.IPv4(192, 168, 1, 10), dst: net.IPv4(10, 0, 0, 1),
+		sport: 40000, dport: 80, flags: tcpFlagSYN, tcpOptions: tcpOptions,
+	}
+}
+
+var progBenchFrames = func() []progBenchFrame {
+	v6 := benchSYN(linuxSYNOptions)
+	v6.src, v6.dst = net.ParseIP("2001:db8::10"), net.ParseIP("2001:db8::1")
+
+	ipOpts := benchSYN(linuxSYNOptions)
+	ipOpts.ipOptions = routerAlertIPOption
+
+	ack := benchSYN(nil)
+	ack.flags = tcpFlagACK
+
+	plain := benchSYN(linuxSYNOptions).frame()
+
+	vlan := benchSYN(linuxSYNOptions)
+	vlan.vlans = []uint16{100}
+	qinq := benchSYN(linuxSYNOptions)
+	qinq.vlans = []uint16{10, 100}
+	v6qinq := v6
+	v6qinq.vlans = []uint16{10, 100}
+	deep := benchSYN(linuxSYNOptions)
+	deep.vlans = []uint16{1, 10, 100}
+
+	// 隧道帧: 外层是 underlay 地址，内层是 Pod 的 SYN
+	underlay := encap{src: net.IPv4(172, 16, 0, 10), dst: net.IPv4(172, 16, 0, 20)}
+	vxlan, geneve, ipip := underlay, underlay, underlay
+	vxlan.kind, geneve.kind, ipip.kind = "vxlan", "geneve", "ipip"
+	vxlan6 := encap{kind: "vxlan", src: net.ParseIP("fd00::10"), dst: net.ParseIP("fd00::20"), udpCsum: true}
+
+	return []progBenchFrame{
+		{"syn", plain, true},
+		{"syn-bare", benchSYN(nil).frame(), true},
+		{"syn-v6", v6.frame(), true},
+		{"syn-ipopts", ipOpts.frame(), true},
+		{"syn-padded", benchSYN(paddedSYNOptions).frame(), true},
+		{"syn-vlan", vlan.frame(), true},
+		{"syn-qinq", qinq.frame(), true},
+		{"syn-v6-qinq", v6qinq.frame(), true},
+		{"syn-3vlan", deep.frame(), false},
+		{"vxlan", vxlan.wrap(plain), true},
+		{"vxlan6-csum", vxlan6.wrap(plain), true},
+		{"geneve-v6", geneve.wrap(v6.frame()), true},
+		{"ipip", ipip.wrap(plain), true},
+		{"syn-full", benchSYN(fullSYNOptions).frame(), false},
+		{"syn-toa", benchSYN(toaSYNOptions).frame(), false},
+		{"ack", ack.frame(), false},
+		{"arp", arpFrame(), false},
+		{"truncated", plain[:14+20+10], false},
+	}
+}()
+
+// runProgOnce 通过 PROG_TEST_RUN 执行一次程序，返回内核测得的单次耗时。
+// 程序会修改 skb，内核的 repeat 循环复用同一个 skb，所以每次都用原始帧重新运行
+func runProgOnce(prog *ebpf.Program, frame []byte) (uint32, time.Duration, error) {
+	return prog.Benchmark(frame, 1, nil)
+}
+
+// measureProg 用 frame 运行 repeat 次程序，返回最后一次的返回值和平均耗时 (ns/packet)
+func measureProg(prog *ebpf.Program, frame []byte, repeat int) (uint32, float64, error) {
+	var total time.Duration
+	var ret uint32
+	for i := 0; i < repeat; i++ {
+		r, d, err := runProgOnce(prog, frame)
+		if err != nil {
+			return 0, 0, err
+		}
+		ret = r
+		total += d
+	}
+	return ret, float64(total.Nanoseconds()) / float64(repeat), nil
+}
+
+// expectInject 按配置修正 inject：部分报文是否被修改取决于功能开关
+func (f progBenchFrame) expectInject(cfg datapathConfig) bool {
+	switch f.name {
+	case "syn-v6":
+		return cfg.enableIPv6
+	case "syn-vlan", "syn-qinq":
+		// 路由上的报文还没有 VLAN 标签，LWT 程序把带标签的测试帧当作非 IP 报文
+		return cfg.engine != engineLWT
+	case "syn-v6-qinq":
+		return cfg.enableIPv6 && cfg.engine != engineLWT
+	case "vxlan", "ipip":
+		// 只有 TC 引擎解析隧道
+		return cfg.tunnels && (cfg.engine == engineTC || cfg.engine == engineTCIngress)
+	case "vxlan6-csum", "geneve-v6":
+		return cfg.tunnels && cfg.enableIPv6 && (cfg.engine == engineTC || cfg.engine == engineTCIngress)
+	case "syn-padded":
+		// 填充帧的 doff 已经是 15，只能压缩填充后注入；XDP 引擎不做压缩，按 no_room 原样放行
+		return cfg.enableCompact && cfg.engine != engineXDP
+	case "syn-toa":
+		return cfg.existingTOA != "skip"
+	}
+	return f.inject
+}
+
+// verifyProg 运行一次程序，检查返回值和输出报文
+func verifyProg(prog *ebpf.Program, cfg datapathConfig, f progBenchFrame) error {
+	out := make([]byte, len(f.frame)+64)
+	opts := ebpf.RunOptions{Data: f.frame, DataOut: out}
+	ret, err := prog.Run(&opts)
+	if err != nil {
+		return err
+	}
+	// TC 程序返回 TC_ACT_OK，不转发的 XDP 程序返回 XDP_PASS
+	if want := progVerdict(cfg); ret != want {
+		return fmt.Errorf("returned %d, want %d", ret, want)
+	}
+	out = opts.DataOut
+	// LWT 程序从 IP 头开始运行，PROG_TEST_RUN 输出的以太网头被清零，按输入补回
+	if cfg.engine == engineLWT && len(out) >= 14 {
+		copy(out, f.frame[:14])
+	}
+
+	// 启用策略时，目的地址未命中策略的报文保持不变也是正确结果
+	if !f.expectInject(cfg) || (cfg.enablePolicy && bytes.Equal(out, f.frame)) {
+		if !bytes.Equal(out, f.frame) {
+			return fmt.Errorf("frame modified:\n in  %x\n out %x", f.frame, out)
+		}
+		return nil
+	}
+	if err := verifyInjected(f.frame, out, uint8(cfg.kindV4), uint8(cfg.kindV6), cfg.existingTOA == "ignore"); err != nil {
+		return fmt.Errorf("%w\n in  %x\n out %x", err, f.frame, out)
+	}
+	return nil
+}
+
+// progVerdict 返回程序放行报文时的返回值
+func progVerdict(cfg datapathConfig) uint32 {
+	if cfg.engine == engineXDP {
+		return 2 // XDP_PASS
+	}
+	return 0 // TC_ACT_OK, LWT 的 BPF_OK
+}
+
+// benchProg 先校验每种报文的输出，再测量平均耗时 (ns/packet)
+// legacy 不为 nil 时多一列，给出同一报文经过旧的 BPF_F_RECOMPUTE_CSUM 写法的耗时，
+// 一次运行即可对比两种校验和更新方式。旧写法不修正 TCP 和 IPv4 头校验和，它的输出不做检查
+func benchProg(prog, legacy *ebpf.Program, cfg datapathConfig, repeat int) error {
+	if legacy == nil {
+		fmt.Printf("%-12s %10s %8s %12s\n", "frame", "retval", "len", "ns/packet")
+	} else {
+		fmt.Printf("%-12s %10s %8s %12s %12s\n", "frame", "retval", "len", "ns/packet", "recompute")
+	}
+	for _, f := range progBenchFrames {
+		if err := verifyProg(prog, cfg, f); err != nil {
+			return fmt.Errorf("frame %s: %w", f.name, err)
+		}
+
+		ret, ns, err := measureProg(prog, f.frame, repeat)
+		if err != nil {
+			return fmt.Errorf("frame %s: %w", f.name, err)
+		}
+		if legacy == nil {
+			fmt.Printf("%-12s %10d %8d %12.1f\n", f.name, ret, len(f.frame), ns)
+			continue
+		}
+		_, legacyNs, err := measureProg(legacy, f.frame, repeat)
+		if err != nil {
+			return fmt.Errorf("frame %s (recompute): %w", f.name, err)
+		}
+		fmt.Printf("%-12s %10d %8d %12.1f %12.1f\n", f.name, ret, len(f.frame), ns, legacyNs)
+	}
+	return nil
+}
+
+// benchProgCsum 运行 prog 测试，并另外加载一份使用旧校验和写法的 TC 程序作为对照
+func benchProgCsum(prog *ebpf.Program, cfg datapathConfig, repeat int) error {
+	legacyCfg := cfg
+	legacyCfg.recomputeCsum = true
+	objs := bpfObjects{}
+	if err := loadDatapath(legacyCfg, &objs); err != nil {
+		return fmt.Errorf("load the BPF_F_RECOMPUTE_CSUM variant: %w", err)
+	}
+	defer objs.Close()
+	return benchProg(prog, objs.InjectTcpOption, cfg, repeat)
+}
+
+// benchAttach 测量把同一个程序挂到 n 个 dummy 网卡并卸载所需的时间
+func benchAttach(prog *ebpf.Program, modes, counts string) error {
+	ns, err := parseCounts(counts)
+	if err != nil {
+		return err
+	}
+
+	fmt.Printf("%-6s %8s %14s %14s %14s\n", "mode", "ifaces", "attach", "per-iface", "detach")
+	for _, m := range strings.Split(modes, ",") {
+		mode, err := parseAttachMode(m)
+		if err != nil {
+			return err
+		}
+		for _, n := range ns {
+			if err := benchAttachOnce(prog, mode, n); err != nil {
+				return fmt.Errorf("%s with %d interfaces: %w", mode, n, err)
+			}
+		}
+	}
+	return nil
+}
+
+func benchAttachOnce(prog *ebpf.Program, mode attachMode, n int) error {
+	links, err := createDummyLinks(n)
+	defer deleteLinks(links)
+	if err != nil {
+		return err
+	}
+
+	att := newAttacher(prog, mode, "")
+	attached := make([]attachment, 0, n)
+	defer func() {
+		for _, a := range attached {
+			a.Detach()
+		}
+	}()
+
+	start := time.Now()
+	for _, l := range links {
+		a, err := att.attach(l.Attrs().Index)
+		if err != nil {
+			return err
+		}
+		attached = append(attached, a)
+	}
+	attachDur := time.Since(start)
+
+	start = time.Now()
+	for _, a := range attached {
+		if err := a.Detach(); err != nil {
+			return err
+		}
+	}
+	detachDur := time.Since(start)
+	attached = attached[:0]
+
+	fmt.Printf("%-6s %8d %14s %14s %14s\n", mode, n, attachDur, attachDur/time.Duration(n), detachDur)
+	return nil
+}
+
+// createDummyLinks 创建 n 个处于 up 状态的 dummy 网卡
+func createDummyLinks(n int) ([]netlink.Link, error) {
+	links := make([]netlink.Link, 0, n)
+	for i := 0; i < n; i++ {
+		l := &netlink.Dummy{LinkAttrs: netlink.LinkAttrs{Name: fmt.Sprintf("%s%d", benchIfacePrefix, i)}}
+		if err := netlink.LinkAdd(l); err != nil {
+			return links, fmt.Errorf("create %s: %w", l.Name, err)
+		}
+		links = append(links, l)
+		if err := netlink.LinkSetUp(l); err != nil {
+			return links, fmt.Errorf("set %s up: %w", l.Name, err)
+		}
+	}
+
+	// LinkAdd 不会回填 ifindex，重新查询一遍
+	for i, l := range links {
+		got, err := netlink.LinkByName(l.Attrs().Name)
+		if err != nil {
+			return links, err
+		}
+		links[i] = got
+	}
+	return links, nil
+}
+
+func deleteLinks(links []netlink.Link) {
+	for _, l := range links {
+		if err := netlink.LinkDel(l); err != nil {
+			log.Printf("Failed to delete %s: %v", l.Attrs().Name, err)
+		}
+	}
+}
+
+// benchPolicy 测量策略前缀树规模对 SYN 处理耗时的影响。每种规模单独加载一份程序，
+// 填入 n-1 条不相关的 /32 前缀和一条覆盖测试目的地址的规则
+func benchPolicy(cfg datapathConfig, counts string, repeat int) error {
+	ns, err := parseCounts(counts)
+	if err != nil {
+		return err
+	}
+	syn := progBenchFrames[0].frame
+
+	fmt.Printf("%-10s %10s %12s %12s\n", "prefixes", "retval", "load", "ns/packet")
+	for _, n := range ns {
+		cfg.enablePolicy = true
+		if uint(n) > cfg.policyMaxEntries {
+			cfg.policyMaxEntries = uint(n)
+		}
+		objs := bpfObjects{}
+		if err := loadDatapath(cfg, &objs); err != nil {
+			return err
+		}
+
+		start := time.Now()
+		err := fillBenchPolicy(objs.Policy, n)
+		loadDur := time.Since(start)
+		if err != nil {
+			objs.Close()
+			return fmt.Errorf("%d prefixes: %w", n, err)
+		}
+
+		ret, ns, err := measureProg(objs.InjectTcpOption, syn, repeat)
+		objs.Close()
+		if err != nil {
+			return fmt.Errorf("%d prefixes: %w", n, err)
+		}
+		fmt.Printf("%-10d %10d %12s %12.1f\n", n, ret, loadDur, ns)
+	}
+	return nil
+}
+
+// benchConntrack 比较打开 -conntrack 前后每个 SYN 的耗时。PROG_TEST_RUN 的报文在 conntrack 中
+// 没有对应的连接，测到的是一次查找未命中的开销；命中时另有读取原始元组和释放引用的少量开销
+func benchConntrack(cfg datapathConfig, repeat int) error {
+	if !haveKfunc("bpf_skb_ct_lookup", "nf_conntrack") {
+		return fmt.Errorf("kernel has no bpf_skb_ct_lookup")
+	}
+	var frames []progBenchFrame
+	for _, f := range progBenchFrames {
+		if f.name == "syn" || (f.name == "syn-v6" && cfg.enableIPv6) {
+			frames = append(frames, f)
+		}
+	}
+
+	nsPerPacket := make(map[bool][]float64)
+	for _, ct := range []bool{false, true} {
+		cfg.conntrack = ct
+		objs := bpfObjects{}
+		if err := loadDatapath(cfg, &objs); err != nil {
+			return err
+		}
+		for _, f := range frames {
+			_, ns, err := measureProg(objs.InjectTcpOption, f.frame, repeat)
+			if err != nil {
+				objs.Close()
+				return fmt.Errorf("frame %s: %w", f.name, err)
+			}
+			nsPerPacket[ct] = append(nsPerPacket[ct], ns)
+		}
+		objs.Close()
+	}
+
+	fmt.Printf("%-12s %12s %12s %12s\n", "frame", "ns/packet", "ct ns/packet", "overhead")
+	for i, f := range frames {
+		off, on := nsPerPacket[false][i], nsPerPacket[true][i]
+		fmt.Printf("%-12s %12.1f %12.1f %12.1f\n", f.name, off, on, on-off)
+	}
+	return nil
+}
+
+// fillBenchPolicy 写入 n 条规则：一条 10.0.0.0/8 覆盖测试帧的目的地址，
+// 其余是 100.0.0.0/8 内依次递增、与测试帧无关的 /32 地址
+func fillBenchPolicy(m *ebpf.Map, n int) error {
+	_, cover, _ := net.ParseCIDR("10.0.0.0/8")
+	key := policyKeyFromIPNet(cover)
+	val := policyValue{PortMin: 0, PortMax: 65535}
+	if err := m.Put(&key, &val); err != nil {
+		return err
+	}
+	for i := 1; i < n; i++ {
+		ip := net.IPv4(100, byte(i>>16), byte(i>>8), byte(i))
+		key := policyKeyFromIPNet(&net.IPNet{IP: ip, Mask: net.CIDRMask(32, 32)})
+		if err := m.Put(&key, &val); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// benchConnect 比较不挂程序、TC 引擎 (挂在 lo 的 egress) 和 sockops 引擎 (挂在 cgroup)
+// 三种情况下本机 TCP 建连的速率，并用计数确认每个 SYN 都被注入
+func benchConnect(cfg datapathConfig, n int, cgroup string) error {
+	ln, err := net.Listen("tcp4", "127.0.0.1:0")
+	if err != nil {
+		return err
+	}
+	defer ln.Close()
+	go func() {
+		for {
+			c, err := ln.Accept()
+			if err != nil {
+				return
+			}
+			c.Close()
+		}
+	}()
+	lo, err := net.InterfaceByName("lo")
+	if err != nil {
+		return err
+	}
+
+	fmt.Printf("%-8s %8s %14s %12s %10s\n", "engine", "conns", "elapsed", "conns/s", "injected")
+	for _, name := range []string{"none", string(engineTC), string(engineSockops)} {
+		if err := benchConnectOnce(cfg, name, ln.Addr().String(), lo.Index, cgroup, n); err != nil {
+			return fmt.Errorf("engine %s: %w", name, err)
+		}
+	}
+	return nil
+}
+
+func benchConnectOnce(cfg datapathConfig, name, addr string, loIndex int, cgroup string, n int) error {
+	var (
+		objs bpfObjects
+		a    attachment
+		slot int
+		err  error
+	)
+	switch engine(name) {
+	case engineTC:
+		cfg.engine = engineTC
+		if err := loadDatapath(cfg, &objs); err != nil {
+			return err
+		}
+		defer objs.Close()
+		a, err = newAttacher(objs.InjectTcpOption, attachModeAuto, "").attach(loIndex)
+		slot = loIndex
+	case engineSockops:
+		cfg.engine = engineSockops
+		if err := loadDatapath(cfg, &objs); err != nil {
+			return err
+		}
+		defer objs.Close()
+		a, err = attachCgroup(objs.InjectToaSockops, cgroup, "")
+	}
+	if err != nil {
+		return err
+	}
+	if a != nil {
+		defer a.Detach()
+	}
+
+	start := time.Now()
+	for i := 0; i < n; i++ {
+		c, err := net.Dial("tcp4", addr)
+		if err != nil {
+			return err
+		}
+		// 以 RST 关闭，避免大量 TIME_WAIT 占满本地端口
+		c.(*net.TCPConn).SetLinger(0)
+		c.Close()
+	}
+	elapsed := time.Since(start)
+
+	injected := "-"
+	if a != nil && cfg.enableStats {
+		st, err := newStatsReader(objs.Stats, uint32(cfg.statsSlots)).read(slot)
+		if err != nil {
+			return err
+		}
+		injected = strconv.FormatUint(st.injected(), 10)
+	}
+	fmt.Printf("%-8s %8d %14s %12.0f %10s\n", name, n, elapsed, float64(n)/elapsed.Seconds(), injected)
+	return nil
+}
+
+// benchXDP 测试 XDP 引擎：先用 PROG_TEST_RUN 校验并测量每种报文，再把程序挂到 veth 的一端，
+// 从另一端用 AF_PACKET 发送 SYN，测量经过 XDP 入口注入的速率。两项测试都关闭重定向，
+// 注入后的报文交给协议栈
+func benchXDP(cfg datapathConfig, repeat, frames int) error {
+	cfg.engine = engineXDP
+	cfg.xdpRedirect = false
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		return err
+	}
+	defer objs.Close()
+
+	if err := benchProg(objs.InjectToaXdp, nil, cfg, repeat); err != nil {
+		return err
+	}
+	fmt.Println()
+	return benchVeth(&objs, cfg, frames)
+}
+
+// benchLWT 用 PROG_TEST_RUN 校验并测量 LWT 程序。挂在路由上时只有去往后端网段的报文才会进入程序，
+// 其余流量的开销为 0，这里测的是进入程序的报文的单包耗时，可以直接和 prog 测试的 TC 程序对比
+func benchLWT(cfg datapathConfig, repeat int) error {
+	cfg.engine = engineLWT
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		return err
+	}
+	defer objs.Close()
+	return benchProg(objs.InjectToaLwt, nil, cfg, repeat)
+}
+
+// benchVeth 创建一对 veth，把 XDP 程序挂到 v1，
+// 从 v0 发送 frames 个 SYN 并用计数确认每个报文都被注入
+func benchVeth(objs *bpfObjects, cfg datapathConfig, frames int) error {
+	v0, v1, err := createVethPair()
+	if err != nil {
+		return err
+	}
+	defer netlink.LinkDel(v0)
+	tx, rx := v0.Attrs().Index, v1.Attrs().Index
+
+	a, err := newAttacher(objs.InjectToaXdp, attachModeXDP, "").attach(rx)
+	if err != nil {
+		return err
+	}
+	defer a.Detach()
+
+	stats := newStatsReader(objs.Stats, uint32(cfg.statsSlots))
+	before, err := stats.read(rx)
+	if err != nil {
+		return err
+	}
+	elapsed, err := sendFrames(tx, progBenchFrames[0].frame, frames)
+	if err != nil {
+		return err
+	}
+	after, err := stats.read(rx)
+	if err != nil {
+		return err
+	}
+
+	fmt.Printf("%-8s %10s %14s %12s %10s\n", "mode", "frames", "elapsed", "pps", "injected")
+	injected := "-"
+	if cfg.enableStats {
+		n := after.injected() - before.injected()
+		if !cfg.enablePolicy && n != uint64(frames) {
+			return fmt.Errorf("injected %d of %d frames", n, frames)
+		}
+		injected = strconv.FormatUint(n, 10)
+	}
+	fmt.Printf("%-8s %10d %14s %12.0f %10s\n", a.Mode(), frames, elapsed, float64(frames)/elapsed.Seconds(), injected)
+	return nil
+}
+
+// createVethPair 创建处于 up 状态的 injbench-v0/injbench-v1。
+// 删除 v0 时 v1 随之删除，调用方只需要删除 v0
+func createVethPair() (v0, v1 netlink.Link, err error) {
+	veth := &netlink.Veth{LinkAttrs: netlink.LinkAttrs{Name: benchIfacePrefix + "-v0"}, PeerName: benchIfacePrefix + "-v1"}
+	if err := netlink.LinkAdd(veth); err != nil {
+		return nil, nil, fmt.Errorf("create veth: %w", err)
+	}
+	var links [2]netlink.Link
+	for i, name := range []string{veth.Name, veth.PeerName} {
+		l, err := netlink.LinkByName(name)
+		if err == nil {
+			err = netlink.LinkSetUp(l)
+		}
+		if err != nil {
+			netlink.LinkDel(veth)
+			return nil, nil, fmt.Errorf("set %s up: %w", name, err)
+		}
+		links[i] = l
+	}
+	return links[0], links[1], nil
+}
+
+// sendFrames 用 AF_PACKET 从 ifindex 发送 n 次 frame，返回耗时。
+// veth 在发送方的上下文中完成对端的收包处理，耗时也包含了对端程序和协议栈的开销
+func sendFrames(ifindex int, frame []byte, n int) (time.Duration, error) {
+	fd, err := unix.Socket(unix.AF_PACKET, unix.SOCK_RAW, 0)
+	if err != nil {
+		return 0, fmt.Errorf("open packet socket: %w", err)
+	}
+	defer unix.Close(fd)
+	to := &unix.SockaddrLinklayer{Ifindex: ifindex}
+
+	start := time.Now()
+	for i := 0; i < n; i++ {
+		if err := unix.Sendto(fd, frame, 0, to); err != nil {
+			return 0, fmt.Errorf("send: %w", err)
+		}
+	}
+	return time.Since(start), nil
+}
+
+// benchForward 比较转发网关上的三种做法: egress 挂载 (报文经过 netfilter 和路由后在出口注入)、
+// 只在 ingress 注入、ingress 注入后用 bpf_redirect_neigh 绕过协议栈。
+// 报文从 veth 的 v0 端发出，经 v1 进入本机，路由到 dummy 网卡 injbench-out 上的 10.0.0.0/24，
+// 以 dummy 的发送计数作为送达的报文数。SYN 测注入加转发，ACK 测同一流后续报文的转发
+func benchForward(cfg datapathConfig, repeat, frames int) error {
+	cfg.engine = engineTCIngress
+	cfg.ingressRedirect = false
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		return err
+	}
+	err := benchProg(objs.InjectToaIngress, nil, cfg, repeat)
+	objs.Close()
+	if err != nil {
+		return err
+	}
+	fmt.Println()
+
+	restore, err := enableForwarding()
+	if err != nil {
+		return err
+	}
+	defer restore()
+
+	v0, v1, err := createVethPair()
+	if err != nil {
+		return err
+	}
+	defer netlink.LinkDel(v0)
+	out := &netlink.Dummy{LinkAttrs: netlink.LinkAttrs{Name: benchIfacePrefix + "-out"}}
+	if err := netlink.LinkAdd(out); err != nil {
+		return fmt.Errorf("create %s: %w", out.Name, err)
+	}
+	defer netlink.LinkDel(out)
+	if err := netlink.LinkSetUp(out); err != nil {
+		return err
+	}
+	// v1 上的地址让 SYN 的源地址 192.168.1.10 通过反向路径检查
+	for _, a := range []struct {
+		link netlink.Link
+		addr string
+	}{{v1, "192.168.1.1/24"}, {out, "10.0.0.2/24"}} {
+		addr, err := netlink.ParseAddr(a.addr)
+		if err != nil {
+			return err
+		}
+		if err := netlink.AddrAdd(a.link, addr); err != nil {
+			return fmt.Errorf("add %s to %s: %w", a.addr, a.link.Attrs().Name, err)
+		}
+	}
+
+	// 目的 MAC 必须是 v1 的地址，否则报文不会被转发
+	ack := benchSYN(nil)
+	ack.flags = tcpFlagACK
+	frameSet := []progBenchFrame{{name: "syn", frame: progBenchFrames[0].frame}, {name: "ack", frame: ack.frame()}}
+	for i := range frameSet {
+		f := append([]byte(nil), frameSet[i].frame...)
+		copy(f, v1.Attrs().HardwareAddr)
+		frameSet[i].frame = f
+	}
+
+	fmt.Printf("%-18s %-6s %10s %14s %12s %10s\n", "mode", "frame", "frames", "elapsed", "pps", "delivered")
+	for _, mode := range []string{"egress", "ingress", "ingress+redirect"} {
+		if err := benchForwardOnce(cfg, mode, v0, v1, out, frameSet, frames); err != nil {
+			return fmt.Errorf("%s: %w", mode, err)
+		}
+	}
+	return nil
+}
+
+func benchForwardOnce(cfg datapathConfig, mode string, v0, v1, out netlink.Link, frameSet []progBenchFrame, frames int) error {
+	objs := bpfObjects{}
+	var att *attacher
+	ifindex := v1.Attrs().Index
+	switch mode {
+	case "egress":
+		cfg.engine = engineTC
+	default:
+		cfg.engine = engineTCIngress
+		cfg.ingressRedirect = mode == "ingress+redirect"
+	}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		return err
+	}
+	defer objs.Close()
+	if cfg.engine == engineTC {
+		att = newAttacher(objs.InjectTcpOption, attachModeAuto, "")
+		ifindex = out.Attrs().Index
+	} else {
+		att = newAttacher(objs.InjectToaIngress, attachModeAuto, "")
+		att.ingress = true
+	}
+	a, err := att.attach(ifindex)
+	if err != nil {
+		return err
+	}
+	defer a.Detach()
+
+	for _, f := range frameSet {
+		before, err := txPackets(out)
+		if err != nil {
+			return err
+		}
+		elapsed, err := sendFrames(v0.Attrs().Index, f.frame, frames)
+		if err != nil {
+			return err
+		}
+		// 等待 backlog 中剩余的报文处理完
+		time.Sleep(100 * time.Millisecond)
+		after, err := txPackets(out)
+		if err != nil {
+			return err
+		}
+		fmt.Printf("%-18s %-6s %10d %14s %12.0f %10d\n", mode, f.name, frames, elapsed,
+			float64(frames)/elapsed.Seconds(), after-before)
+	}
+	return nil
+}
+
+// txPackets 返回网卡的发送报文计数
+func txPackets(l netlink.Link) (uint64, error) {
+	got, err := netlink.LinkByName(l.Attrs().Name)
+	if err != nil {
+		return 0, err
+	}
+	if got.Attrs().Statistics == nil {
+		return 0, fmt.Errorf("no statistics for %s", l.Attrs().Name)
+	}
+	return got.Attrs().Statistics.TxPackets, nil
+}
+
+// enableForwarding 打开 IPv4 转发，返回恢复原值的函数
+func enableForwarding() (func(), error) {
+	const path = "/proc/sys/net/ipv4/ip_forward"
+	old, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	if err := os.WriteFile(path, []byte("1\n"), 0o644); err != nil {
+		return nil, fmt.Errorf("enable ip_forward: %w", err)
+	}
+	return func() {
+		if err := os.WriteFile(path, old, 0o644); err != nil {
+			log.Printf("Failed to restore %s: %v", path, err)
+		}
+	}, nil
+}
@@ -3,100 +3,1638 @@
 #include <linux/bpf.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/in.h>
+#include <linux/in6.h>
 #include <linux/tcp.h>
+#include <linux/udp.h>
 #include <linux/pkt_cls.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 char __license[] SEC("license") = "GPL";
 
+#ifndef AF_INET
+#define AF_INET  2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
 struct toa_data {
     __u8 kind;
     __u8 len;
     __u16 port;
     __u32 ip;
-} __attribute__((packed));
+} __attribute__((packed, aligned(4)));
+
+// IPv6 TOA 选项: kind(1) + len(1) + port(2) + addr(16) = 20 字节
+struct toa_data_v6 {
+    __u8 kind;
+    __u8 len;
+    __u16 port;
+    __u8 ip[16];
+} __attribute__((packed, aligned(4)));
+
+// 选项 kind 由用户态在加载前通过 RewriteConstants 改写
+volatile const __u8 toa_kind    = 254;
+volatile const __u8 toa_kind_v6 = 253;
+
+// 报文中已经带有 TOA 选项 (例如经过了上一跳的注入器) 时的处理方式
+#define EXISTING_TOA_SKIP      0   // 保持报文不变
+#define EXISTING_TOA_OVERWRITE 1   // 原地改写为本机看到的地址
+#define EXISTING_TOA_IGNORE    2   // 不检查，直接再追加一个
+volatile const __u8 existing_toa_mode = EXISTING_TOA_SKIP;
+
+// 功能开关同样在加载前改写。.rodata 在加载时被冻结，verifier 把这些值当作已知常量，
+// 关闭的功能对应的分支会被当作死代码剪掉，不占用热路径上的指令
+volatile const bool enable_ipv6    = true;  // 处理 IPv6 SYN
+volatile const bool enable_stats   = true;  // 维护 per-CPU 计数
+volatile const bool enable_compact = true;  // 优先复用 NOP/EOL 填充，关闭后总是扩展包尾
+// 只供 bench 对比: 扩展报文时按旧写法用 BPF_F_RECOMPUTE_CSUM 写入，不增量更新 TCP 和 IPv4 头校验和
+volatile const bool recompute_csum = false;
+
+// stat_reason 对应程序的每一个出口分支，顺序必须和 stats.go 中的 statReasons 一致
+enum stat_reason {
+    STAT_INJECTED_GROW = 0,   // 扩展包尾后注入
+    STAT_INJECTED_COMPACT,    // 压缩 NOP/EOL 填充后原地注入，包长不变
+    STAT_INJECTED_SOCKOPS,    // sockops 引擎在内核构造 SYN 时写入
+    STAT_EXISTING_SKIPPED,    // 已有 TOA 选项，保持不变
+    STAT_EXISTING_REWRITTEN,  // 已有 TOA 选项，原地改写地址
+    STAT_POLICY_SKIPPED,      // 目的地址/端口未命中策略
+    STAT_NOT_IP,         // 非 IPv4/IPv6 报文
+    STAT_NOT_TCP,        // 非 TCP 报文，或 IPv4 分片
+    STAT_NOT_SYN,        // 非 SYN 报文
+    STAT_TRUNCATED,      // 头部越界或长度字段非法
+    STAT_BAD_OPTIONS,    // TCP 选项格式非法
+    STAT_IPV6_EXTHDR,    // IPv6 扩展头过多、未知或是分片
+    STAT_NO_ROOM,        // TCP 头没有空间容纳选项 (doff 超过 15)
+    STAT_HAS_PAYLOAD,    // SYN 携带数据
+    STAT_GROW_FAILED,    // bpf_skb_change_tail 失败
+    STAT_STORE_FAILED,   // bpf_skb_store_bytes 失败
+    STAT_CSUM_FAILED,    // 校验和更新失败
+    STAT_INJECTED_XDP,   // XDP 引擎注入
+    STAT_NOT_FORWARDED,  // XDP 引擎: 路由查找表明本机不转发这个报文，交给协议栈
+    STAT_FORWARDED,      // 路径计数: TC ingress 引擎绕过协议栈从出口网卡直接发出，与出口原因分别计数
+    STAT_VLAN,           // 路径计数: 报文中带一层 VLAN 标签
+    STAT_QINQ,           // 路径计数: 报文中带两层 VLAN 标签 (QinQ)
+    STAT_VLAN_TOO_DEEP,  // VLAN 标签超过两层
+    STAT_TUNNEL,         // 路径计数: VXLAN/Geneve/IPIP 封装的报文，按内层处理
+    STAT_FWD_NO_NEIGH,   // 路径计数: XDP 引擎查到路由但邻居未解析，交给协议栈
+    STAT_FWD_NO_TX_PORT, // 路径计数: XDP 引擎的出口网卡不在 tx_ports 中，交给协议栈
+    STAT_FWD_TTL,        // 路径计数: XDP 引擎转发时 TTL/hop limit 即将耗尽，交给协议栈
+    STAT_FWD_TRUNCATED,  // 路径计数: XDP 引擎注入后重新读取头部越界，交给协议栈
+    STAT_MAX,
+};
+
+struct datapath_stats {
+    __u64 count[STAT_MAX];
+};
+
+// 计数按网卡 ifindex 存放，ifindex 超出 stats_slots 的网卡计入 0 号槽位。
+// stats_slots 和 map 大小由用户态在加载前一起设置
+volatile const __u32 stats_slots = 1024;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1024);
+    __type(key, __u32);
+    __type(value, struct datapath_stats);
+} stats SEC(".maps");
+
+// count_slot 在 slot 对应的槽位上记录一次出口原因。per-CPU 计数不需要原子操作
+static __always_inline void count_slot(__u32 slot, enum stat_reason reason)
+{
+    if (!enable_stats) return;
+
+    if (slot >= stats_slots) slot = 0;
+    struct datapath_stats *st = bpf_map_lookup_elem(&stats, &slot);
+    if (st && reason < STAT_MAX) st->count[reason]++;
+}
+
+// count 按报文的网卡记录出口原因，返回值直接作为 TC 程序返回值
+static __always_inline int count(struct __sk_buff *skb, enum stat_reason reason)
+{
+    count_slot(skb->ifindex, reason);
+    return TC_ACT_OK;
+}
+
+// 目的地址策略: 启用后只有目的前缀命中 (且目的端口在范围内) 的 SYN 才会注入，
+// 在修改报文之前判断。IPv4 地址以 IPv4-mapped IPv6 (::ffff:a.b.c.d) 形式存放，
+// v4/v6 共用一棵前缀树
+volatile const bool policy_enabled = false;
+
+struct policy_key {
+    __u32 prefixlen;
+    __u8 addr[16];
+};
+
+// 端口范围为主机字节序的闭区间，0-65535 表示不限端口。
+// 只检查最长匹配前缀上的端口范围，不会回退到更短的前缀
+struct policy_value {
+    __u16 port_min;
+    __u16 port_max;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, 65536);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct policy_key);
+    __type(value, struct policy_value);
+} policy SEC(".maps");
+
+static __always_inline bool policy_allows(struct policy_key *key, __be16 dport)
+{
+    key->prefixlen = sizeof(key->addr) * 8;
+    struct policy_value *val = bpf_map_lookup_elem(&policy, key);
+    if (!val) return false;
+
+    __u16 port = bpf_ntohs(dport);
+    return port >= val->port_min && port <= val->port_max;
+}
+
+// 代理提供的客户端地址: 七层代理在连接上游之前通过 setsockopt(IPPROTO_TCP, toa_sockopt)
+// 为上游 socket 设置下游客户端的地址，注入的是这个地址而不是 SYN 的源地址 (代理自己)。
+// cgroup/setsockopt 钩子把地址存进 socket 本地存储；sockops 引擎直接读取，
+// TC 引擎看不到 socket 存储，由 proxy_addr_sockops 在发送 SYN 之前按 socket cookie 复制一份
+volatile const bool proxy_addr = false;
+volatile const __u32 toa_sockopt = 254;
+
+// client_addr 与接收端的 struct toa_addr 布局相同: IPv4 地址以 IPv4-mapped 形式存放，
+// family 决定注入 IPv4 还是 IPv6 选项，与连接本身的地址族无关
+struct client_addr {
+    __be16 port;
+    __u16 family;
+    __u8 addr[16];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_SK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct client_addr);
+} proxy_clients SEC(".maps");
+
+// 正在握手的连接按 socket cookie 索引的地址，连接建立后删除；
+// 握手失败的连接留下的条目由 LRU 淘汰
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, __u64);
+    __type(value, struct client_addr);
+} proxy_cookies SEC(".maps");
+
+// proxy_client 返回代理为发送 skb 的 socket 设置的客户端地址。
+// 转发的报文没有 socket，cookie 为 0
+static __always_inline struct client_addr *proxy_client(struct __sk_buff *skb)
+{
+    if (!proxy_addr) return NULL;
+
+    __u64 cookie = bpf_get_socket_cookie(skb);
+    if (!cookie) return NULL;
+    return bpf_map_lookup_elem(&proxy_cookies, &cookie);
+}
+
+// 源地址还原: NAT 网关 egress 上看到的是 SNAT 之后的源地址 (网关自己)。启用后用 conntrack kfunc
+// 查出连接，注入原始方向 (SNAT 之前) 的客户端地址和端口 (内核 6.0+，需要 nf_conntrack)。
+// kfunc 声明为 weak，内核没有时用户态不会打开 ct_lookup，调用作为死代码被剪掉
+volatile const bool ct_lookup = false;
+
+// 以下结构只声明用到的字段，偏移在加载时按内核 BTF 重定位 (CO-RE)
+struct bpf_ct_opts___toa {
+    __s32 netns_id;
+    __s32 error;
+    __u8 l4proto;
+    __u8 dir;
+    __u8 reserved[2];
+};
+#define CT_OPTS_SZ 12
+
+union nf_inet_addr___toa {
+    __u32 all[4];
+    __be32 ip;
+} __attribute__((preserve_access_index));
+
+union nf_conntrack_man_proto___toa {
+    __be16 all;
+} __attribute__((preserve_access_index));
+
+struct nf_conntrack_man___toa {
+    union nf_inet_addr___toa u3;
+    union nf_conntrack_man_proto___toa u;
+} __attribute__((preserve_access_index));
+
+struct nf_conntrack_tuple___toa {
+    struct nf_conntrack_man___toa src;
+} __attribute__((preserve_access_index));
+
+struct nf_conntrack_tuple_hash___toa {
+    struct nf_conntrack_tuple___toa tuple;
+} __attribute__((preserve_access_index));
+
+#define IP_CT_DIR_ORIGINAL 0
+
+struct nf_conn___toa {
+    struct nf_conntrack_tuple_hash___toa tuplehash[2];
+} __attribute__((preserve_access_index));
+
+extern struct nf_conn___toa *bpf_skb_ct_lookup(struct __sk_buff *skb, struct bpf_sock_tuple *tuple, __u32 tuple_sz,
+                                               struct bpf_ct_opts___toa *opts, __u32 opts_sz) __ksym __weak;
+extern void bpf_ct_release(struct nf_conn___toa *ct) __ksym __weak;
 
+// ct_original_source 用回包方向的元组 (目的 -> 报文的源) 查找连接，SNAT 前后这个元组都能命中。
+// 找到时把原始方向的源地址和端口填进 out
+static __always_inline bool ct_original_source(struct __sk_buff *skb, struct bpf_sock_tuple *tuple,
+                                               const __u32 tuple_sz, const bool ipv4, struct client_addr *out)
+{
+    struct bpf_ct_opts___toa opts = { .netns_id = BPF_F_CURRENT_NETNS, .l4proto = IPPROTO_TCP };
+    struct nf_conn___toa *ct = bpf_skb_ct_lookup(skb, tuple, tuple_sz, &opts, CT_OPTS_SZ);
+    if (!ct) return false;
+
+    out->port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all;
+    if (ipv4) {
+        __be32 ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+        out->family = AF_INET;
+        out->addr[10] = 0xff;
+        out->addr[11] = 0xff;
+        __builtin_memcpy(&out->addr[12], &ip, sizeof(ip));
+    } else {
+        out->family = AF_INET6;
+        for (int i = 0; i < 4; i++) {
+            __u32 w = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.all[i];
+            __builtin_memcpy(&out->addr[i * 4], &w, sizeof(w));
+        }
+    }
+    bpf_ct_release(ct);
+    return true;
+}
+
+#define TCP_CSUM_OFF   offsetof(struct tcphdr, check)
+#define TCP_DOFF_OFF   12
+#define TCP_MAX_HDR_LEN 60
+#define TCP_MAX_OPT_LEN (TCP_MAX_HDR_LEN - sizeof(struct tcphdr))
+
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+
+// 选项扫描用的 per-CPU 缓冲区，放在 map 中以便用掩码后的变量下标访问
+#define OPT_BUF_MASK 63
+
+struct opt_scratch {
+    __u8 in[OPT_BUF_MASK + 1];   // 原始选项
+    __u8 out[OPT_BUF_MASK + 1];  // 去掉 NOP/EOL 后的选项
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct opt_scratch);
+} scratch SEC(".maps");
+
+// 隧道感知: 在 underlay 网卡上看到的 VXLAN/Geneve (UDP) 和 IPIP/IP6IP6 报文中找到内层 SYN 注入，
+// 再修正外层长度和校验和，一个挂载点覆盖所有 Pod，不用逐个挂到 veth 上。
+// 端口为主机字节序，与 Linux vxlan/geneve 设备的默认目的端口一致
+volatile const bool enable_tunnels = false;
+volatile const __u16 vxlan_port  = 4789;
+volatile const __u16 geneve_port = 6081;
+
+// 外层 UDP 校验和的差值按内层 IP 头起到 TCP 头结尾整段计算，注入前后各存一份。
+// 内层 IPv4 头 + TCP 头最长 120 字节，再加上扩展后的 IPv6 选项
+#define TUNNEL_MAX_HDR_LEN 192
+
+struct tunnel_scratch {
+    __u8 before[TUNNEL_MAX_HDR_LEN];
+    __u8 after[TUNNEL_MAX_HDR_LEN];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct tunnel_scratch);
+} tunnel_scratch SEC(".maps");
+
+// IPv6 扩展头最多遍历的层数，保证循环有界
+#define IPV6_MAX_EXT_HDRS 6
+
+struct ipv6_frag_hdr {
+    __u8 nexthdr;
+    __u8 reserved;
+    __be16 frag_off;
+    __be32 identification;
+};
+
+#define IPV6_FRAG_OFFSET_MF 0xFFF9 // 分片偏移 + MF 标志
+
+// tunnel_ctx 记录外层封装中注入后需要随之修正的字段，由 parse_tunnel 填写
+struct tunnel_ctx {
+    __u32 inner_l3_off;    // 内层 IP 头偏移
+    __u32 outer_len_off;   // 外层 IPv4 tot_len / IPv6 payload_len 的偏移
+    __u32 outer_csum_off;  // 外层 IPv4 头校验和偏移，IPv6 不使用
+    __u32 udp_off;         // 外层 UDP 头偏移，IPIP 没有 UDP 头时为 0
+    __be16 outer_len;      // 原外层 tot_len / payload_len
+    __be16 udp_len;        // 原外层 UDP 长度
+    bool outer_ipv4;
+    bool present;          // 报文是隧道报文，ctx 中的偏移都指向内层
+};
+
+// inject_ctx 记录一次注入所需的偏移和旧值，由 v4/v6 解析阶段填写
+struct inject_ctx {
+    __u32 l4_off;          // TCP 头偏移
+    __u32 tcp_hdr_len;     // 原 TCP 头长度
+    __u32 l3_len_off;      // IPv4 tot_len / IPv6 payload_len 的偏移
+    __u32 l3_csum_off;     // IPv4 头校验和偏移，IPv6 不使用
+    __u32 l3_end;          // 按 L3 长度字段计算的报文结尾偏移
+    __be16 l3_len;         // 原 tot_len / payload_len
+    __be16 doff_flags;     // 原 TCP doff + flags 字
+    bool ipv4;
+    struct tunnel_ctx tun;
+};
+
+// grow_option 在 TCP 头尾部追加 opt_len 字节的选项，并增量更新 L3/L4 长度和校验和。
+// opt_len 必须是编译期常量 (调用方内联后传入 sizeof)
+static __always_inline enum stat_reason grow_option(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                       const void *opt, const __u32 opt_len)
+{
+    if (ctx->tcp_hdr_len + opt_len > TCP_MAX_HDR_LEN) return STAT_NO_ROOM;
+
+    // 选项通过扩展包尾写入，要求 TCP 头之后没有负载 (例如 TFO 的 SYN 数据)
+    if (ctx->l3_end != ctx->l4_off + ctx->tcp_hdr_len || skb->len != ctx->l3_end) {
+        return STAT_HAS_PAYLOAD;
+    }
+
+    // --- 1. 【计算阶段】---
+    const __u16 old_doff_flags_word_host = bpf_ntohs(ctx->doff_flags);
+    const __u8 new_doff_val = (old_doff_flags_word_host >> 12) + opt_len / 4;
+    const __be16 new_doff_flags_word_be = bpf_htons((old_doff_flags_word_host & 0x0FFF) | (new_doff_val << 12));
+    const __be16 new_l3_len_be = bpf_htons(bpf_ntohs(ctx->l3_len) + opt_len);
+
+    // TCP 伪首部中的长度字段 (TCP 头 + 数据)
+    const __be16 old_tcp_len_be = bpf_htons(ctx->tcp_hdr_len);
+    const __be16 new_tcp_len_be = bpf_htons(ctx->tcp_hdr_len + opt_len);
+
+    // 新选项字节对 TCP 校验和的贡献
+    const __s64 opt_csum = bpf_csum_diff(NULL, 0, (void *)opt, opt_len, 0);
+    if (opt_csum < 0) return STAT_CSUM_FAILED;
+
+    const __u32 csum_off = ctx->l4_off + TCP_CSUM_OFF;
+
+    // --- 2. 【写入阶段】---
+    // 在包尾扩出选项空间。SYN 没有负载，包尾正好是 TCP 头的结尾，
+    // 不需要搬移任何头部，transport_header/csum_start 也保持有效
+    if (bpf_skb_change_tail(skb, skb->len + opt_len, 0) < 0) {
+        return STAT_GROW_FAILED;
+    }
+
+    if (recompute_csum) {
+        // 旧写法: 只让内核按写入的字节更新 skb->csum，TCP 和 IPv4 头校验和保持原值
+        if (bpf_skb_store_bytes(skb, ctx->l4_off + ctx->tcp_hdr_len, opt, opt_len, BPF_F_RECOMPUTE_CSUM) < 0 ||
+            bpf_skb_store_bytes(skb, ctx->l3_len_off, &new_l3_len_be, sizeof(new_l3_len_be), BPF_F_RECOMPUTE_CSUM) < 0 ||
+            bpf_skb_store_bytes(skb, ctx->l4_off + TCP_DOFF_OFF, &new_doff_flags_word_be, sizeof(new_doff_flags_word_be),
+                                BPF_F_RECOMPUTE_CSUM) < 0) {
+            return STAT_STORE_FAILED;
+        }
+        return STAT_INJECTED_GROW;
+    }
+
+    // a. 写入新的 TCP 选项，并把它累加进 TCP 校验和
+    if (bpf_skb_store_bytes(skb, ctx->l4_off + ctx->tcp_hdr_len, opt, opt_len, 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (bpf_l4_csum_replace(skb, csum_off, 0, opt_csum, 0) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+
+    // b. 更新 TCP 数据偏移 (L4)
+    if (bpf_skb_store_bytes(skb, ctx->l4_off + TCP_DOFF_OFF, &new_doff_flags_word_be, sizeof(new_doff_flags_word_be), 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (bpf_l4_csum_replace(skb, csum_off, ctx->doff_flags, new_doff_flags_word_be, sizeof(__be16)) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+
+    // c. 更新 TCP 伪首部长度。对 CHECKSUM_PARTIAL 的包，内核只会更新伪首部部分，
+    //    其余字节由网卡在发送时计算
+    if (bpf_l4_csum_replace(skb, csum_off, old_tcp_len_be, new_tcp_len_be, BPF_F_PSEUDO_HDR | sizeof(__be16)) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+
+    // d. 更新 IPv4 总长度和头校验和 / IPv6 负载长度 (L3)
+    if (bpf_skb_store_bytes(skb, ctx->l3_len_off, &new_l3_len_be, sizeof(new_l3_len_be), 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (ctx->ipv4 && bpf_l3_csum_replace(skb, ctx->l3_csum_off, ctx->l3_len, new_l3_len_be, sizeof(__be16)) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+
+    return STAT_INJECTED_GROW;
+}
+
+struct opt_scan {
+    __u32 used;      // 去掉填充后的选项长度
+    __s32 toa_off;   // 已有 TOA 选项在选项区中的偏移，没有时为 -1
+};
+
+// scan_options 遍历 sc->in 中 optlen 字节的选项。找到 kind/len 与 TOA 相同的选项时
+// 记录其偏移并立即返回；否则把去掉 NOP 和 EOL 之后填充的选项按原顺序紧凑复制到 sc->out。
+// 选项格式非法时返回 -1
+static __always_inline int scan_options(struct opt_scratch *sc, const __u32 optlen,
+                                        const __u8 kind, const __u32 opt_len, struct opt_scan *res)
+{
+    __u32 used = 0, remaining = 0;
+
+    res->toa_off = -1;
+    for (__u32 i = 0; i < TCP_MAX_OPT_LEN; i++) {
+        if (i >= optlen) break;
+        __u8 b = sc->in[i & OPT_BUF_MASK];
+        // remaining 为 0 表示 b 是一个新选项的 kind
+        if (remaining == 0) {
+            if (b == TCPOPT_EOL) break;
+            if (b == TCPOPT_NOP) continue;
+            if (i + 1 >= optlen) return -1;
+            remaining = sc->in[(i + 1) & OPT_BUF_MASK];
+            if (remaining < 2 || i + remaining > optlen) return -1;
+            if (b == kind && remaining == opt_len) {
+                res->toa_off = i;
+                return 0;
+            }
+        }
+        sc->out[used & OPT_BUF_MASK] = b;
+        used++;
+        remaining--;
+    }
+    res->used = used;
+    return 0;
+}
+
+// overwrite_option 把选项区 toa_off 处已有的 TOA 选项原地改写为 opt。
+// 校验和按整个选项区计算差值，避免选项起始于奇数偏移时的字节序问题
+static __always_inline enum stat_reason overwrite_option(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                            struct opt_scratch *sc, const __u32 optlen, __u32 toa_off,
+                                            const void *opt, const __u32 opt_len)
+{
+    if (toa_off > TCP_MAX_OPT_LEN - opt_len) return STAT_BAD_OPTIONS;
+    __builtin_memcpy(sc->out, sc->in, TCP_MAX_OPT_LEN);
+    __builtin_memcpy(sc->out + toa_off, opt, opt_len);
+
+    const __s64 diff = bpf_csum_diff((void *)sc->in, optlen, (void *)sc->out, optlen, 0);
+    if (diff < 0) return STAT_CSUM_FAILED;
+
+    if (bpf_skb_store_bytes(skb, ctx->l4_off + sizeof(struct tcphdr) + toa_off, opt, opt_len, 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (bpf_l4_csum_replace(skb, ctx->l4_off + TCP_CSUM_OFF, 0, diff, 0) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+    return STAT_EXISTING_REWRITTEN;
+}
+
+// rewrite_options 把 TOA 选项追加到 sc->out 中紧凑后的选项之后，剩余部分填 EOL，
+// 然后原地覆盖报文中的选项区。包长、doff 和 L3 头都不变，只需更新 TCP 校验和
+static __always_inline enum stat_reason rewrite_options(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                           struct opt_scratch *sc, const __u32 optlen, __u32 used,
+                                           const void *opt, const __u32 opt_len)
+{
+    if (used > TCP_MAX_OPT_LEN - opt_len) return STAT_NO_ROOM;
+    __builtin_memcpy(sc->out + used, opt, opt_len);
+
+    for (__u32 i = 0; i < TCP_MAX_OPT_LEN; i++) {
+        __u32 k = used + opt_len + i;
+        if (k >= optlen) break;
+        sc->out[k & OPT_BUF_MASK] = TCPOPT_EOL;
+    }
+
+    const __s64 diff = bpf_csum_diff((void *)sc->in, optlen, (void *)sc->out, optlen, 0);
+    if (diff < 0) return STAT_CSUM_FAILED;
+
+    if (bpf_skb_store_bytes(skb, ctx->l4_off + sizeof(struct tcphdr), sc->out, optlen, 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (bpf_l4_csum_replace(skb, ctx->l4_off + TCP_CSUM_OFF, 0, diff, 0) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+    return STAT_INJECTED_COMPACT;
+}
+
+// inject 是 v4/v6 共用的注入入口。已有 TOA 选项时跳过或原地改写；
+// 否则优先复用选项区中的 NOP/EOL 填充原地写入，填充不够时才扩展包尾。
+// 既不检查已有选项也不复用填充时，整个选项扫描都不会被加载。返回出口原因
+static __always_inline enum stat_reason inject_inner(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                  const void *opt, const __u32 opt_len)
+{
+    if (ctx->l3_end < ctx->l4_off + ctx->tcp_hdr_len) return STAT_TRUNCATED;
+
+    const bool scan_needed = enable_compact || existing_toa_mode != EXISTING_TOA_IGNORE;
+    const __u32 optlen = ctx->tcp_hdr_len - sizeof(struct tcphdr);
+    if (scan_needed && optlen >= opt_len && optlen <= TCP_MAX_OPT_LEN) {
+        __u32 zero = 0;
+        struct opt_scratch *sc = bpf_map_lookup_elem(&scratch, &zero);
+        if (!sc) return STAT_STORE_FAILED;
+
+        if (bpf_skb_load_bytes(skb, ctx->l4_off + sizeof(struct tcphdr), sc->in, optlen) < 0) {
+            return STAT_TRUNCATED;
+        }
+        struct opt_scan scan;
+        // 忽略已有选项时传入不可能匹配的 kind 0 (EOL)，扫描只做紧凑
+        const __u8 kind = existing_toa_mode != EXISTING_TOA_IGNORE ? *(const __u8 *)opt : TCPOPT_EOL;
+        if (scan_options(sc, optlen, kind, opt_len, &scan) < 0) {
+            return STAT_BAD_OPTIONS;
+        }
+        if (scan.toa_off >= 0) {
+            if (existing_toa_mode != EXISTING_TOA_OVERWRITE) return STAT_EXISTING_SKIPPED;
+            return overwrite_option(skb, ctx, sc, optlen, scan.toa_off, opt, opt_len);
+        }
+        if (enable_compact && scan.used + opt_len <= optlen) {
+            return rewrite_options(skb, ctx, sc, optlen, scan.used, opt, opt_len);
+        }
+    }
+    return grow_option(skb, ctx, opt, opt_len);
+}
+
+// inject_tunnel 向隧道报文的内层 SYN 注入，再修正外层的长度和校验和。外层 UDP 校验和为 0 (发送方未启用，
+// IPv4 VXLAN 的常见配置) 时保持为 0，否则把内层头部注入前后的校验和差值累加进去。
+// 内层 IP 头距外层 UDP 头的偏移总是偶数，整段差值不受字节序影响
+static __always_inline enum stat_reason inject_tunnel(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                                      const void *opt, const __u32 opt_len)
+{
+    const struct tunnel_ctx *tun = &ctx->tun;
+    const __u32 udp_csum_off = tun->udp_off + offsetof(struct udphdr, check);
+    const __u32 hdr_len = ctx->l4_off + ctx->tcp_hdr_len - tun->inner_l3_off;
+    struct tunnel_scratch *ts = NULL;
+    __u16 udp_csum = 0;
+
+    if (tun->udp_off && bpf_skb_load_bytes(skb, udp_csum_off, &udp_csum, sizeof(udp_csum)) < 0) {
+        return STAT_TRUNCATED;
+    }
+    if (udp_csum) {
+        // bpf_csum_diff 要求长度是 4 的倍数，IP 头和 TCP 头长度本来就是
+        if (hdr_len == 0 || hdr_len > TUNNEL_MAX_HDR_LEN - opt_len || hdr_len % 4) return STAT_NO_ROOM;
+        __u32 zero = 0;
+        ts = bpf_map_lookup_elem(&tunnel_scratch, &zero);
+        if (!ts) return STAT_STORE_FAILED;
+        if (bpf_skb_load_bytes(skb, tun->inner_l3_off, ts->before, hdr_len) < 0) return STAT_TRUNCATED;
+    }
+
+    const enum stat_reason reason = inject_inner(skb, ctx, opt, opt_len);
+    __u32 grown;
+    switch (reason) {
+    case STAT_INJECTED_GROW:
+        grown = opt_len;
+        break;
+    case STAT_INJECTED_COMPACT:
+    case STAT_EXISTING_REWRITTEN:
+        grown = 0;
+        break;
+    default:
+        return reason;
+    }
+
+    // 内层头部的变化 (选项、doff、TCP 校验和、内层长度和头校验和) 整体累加进外层 UDP 校验和。
+    // BPF_F_MARK_MANGLED_0 保证结果为 0 时写成 0xffff，不被误认为没有校验和
+    if (ts) {
+        if (bpf_skb_load_bytes(skb, tun->inner_l3_off, ts->after, hdr_len + grown) < 0) return STAT_TRUNCATED;
+        const __s64 diff = bpf_csum_diff((void *)ts->before, hdr_len, (void *)ts->after, hdr_len + grown, 0);
+        if (diff < 0) return STAT_CSUM_FAILED;
+        if (bpf_l4_csum_replace(skb, udp_csum_off, 0, diff, BPF_F_MARK_MANGLED_0) < 0) return STAT_CSUM_FAILED;
+    }
+    if (!grown) return reason;
+
+    // 扩展包尾后外层 L3 长度和 UDP 长度同样增加 grown
+    const __be16 outer_len = bpf_htons(bpf_ntohs(tun->outer_len) + grown);
+    if (bpf_skb_store_bytes(skb, tun->outer_len_off, &outer_len, sizeof(outer_len), 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    if (tun->outer_ipv4 && bpf_l3_csum_replace(skb, tun->outer_csum_off, tun->outer_len, outer_len, sizeof(__be16)) < 0) {
+        return STAT_CSUM_FAILED;
+    }
+    if (!tun->udp_off) return reason;
+
+    const __be16 udp_len = bpf_htons(bpf_ntohs(tun->udp_len) + grown);
+    if (bpf_skb_store_bytes(skb, tun->udp_off + offsetof(struct udphdr, len), &udp_len, sizeof(udp_len), 0) < 0) {
+        return STAT_STORE_FAILED;
+    }
+    // UDP 长度同时出现在 UDP 头和伪首部中
+    if (udp_csum) {
+        if (bpf_l4_csum_replace(skb, udp_csum_off, tun->udp_len, udp_len, BPF_F_MARK_MANGLED_0 | sizeof(__be16)) < 0 ||
+            bpf_l4_csum_replace(skb, udp_csum_off, tun->udp_len, udp_len,
+                                BPF_F_MARK_MANGLED_0 | BPF_F_PSEUDO_HDR | sizeof(__be16)) < 0) {
+            return STAT_CSUM_FAILED;
+        }
+    }
+    return reason;
+}
+
+// inject 按出口原因计数，隧道报文额外修正外层
+static __always_inline int inject(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                  const void *opt, const __u32 opt_len)
+{
+    if (enable_tunnels && ctx->tun.present) return count(skb, inject_tunnel(skb, ctx, opt, opt_len));
+    return count(skb, inject_inner(skb, ctx, opt, opt_len));
+}
+
+// inject_client 注入代理设置的客户端地址。选项的地址族跟随客户端，
+// IPv4 连接上也可能写入 IPv6 选项，反之亦然
+static __always_inline int inject_client(struct __sk_buff *skb, const struct inject_ctx *ctx,
+                                         const struct client_addr *c)
+{
+    if (c->family == AF_INET) {
+        struct toa_data opt = { .kind = toa_kind, .len = sizeof(opt), .port = c->port };
+        __builtin_memcpy(&opt.ip, &c->addr[12], sizeof(opt.ip));
+        return inject(skb, ctx, &opt, sizeof(opt));
+    }
+    struct toa_data_v6 opt = { .kind = toa_kind_v6, .len = sizeof(opt), .port = c->port };
+    __builtin_memcpy(opt.ip, c->addr, sizeof(opt.ip));
+    return inject(skb, ctx, &opt, sizeof(opt));
+}
+
+// parse_tcp 检查 l4_off 处的 TCP 头是否是 SYN，并填写 ctx。
+// 失败时返回 NULL，*reason 为跳过原因
+static __always_inline struct tcphdr *parse_tcp(void *data, void *data_end, struct inject_ctx *ctx,
+                                                enum stat_reason *reason)
+{
+    *reason = STAT_TRUNCATED;
+    struct tcphdr *tcph = data + ctx->l4_off;
+    if ((void *)tcph + sizeof(*tcph) > data_end) return NULL;
+
+    *reason = STAT_NOT_SYN;
+    if (!tcph->syn) return NULL;
+
+    *reason = STAT_TRUNCATED;
+    ctx->tcp_hdr_len = tcph->doff * 4;
+    if (ctx->tcp_hdr_len < sizeof(*tcph)) return NULL;
+
+    ctx->doff_flags = *(__be16 *)((void *)tcph + TCP_DOFF_OFF);
+    return tcph;
+}
+
+#define IP_FRAG_MASK 0x3FFF // 分片偏移 + MF 标志
+
+static __always_inline int handle_ipv4(struct __sk_buff *skb, const __u32 l3_off, const struct tunnel_ctx *tun)
+{
+    void *data_end = (void *)(long)skb->data_end;
+    void *data     = (void *)(long)skb->data;
+
+    struct iphdr *iph = data + l3_off;
+    if ((void *)iph + sizeof(*iph) > data_end) return count(skb, STAT_TRUNCATED);
+    if (iph->protocol != IPPROTO_TCP) return count(skb, STAT_NOT_TCP);
+    // 分片不做处理: 后续分片的负载可能恰好像一个 SYN 头，首个分片变长会使后续分片的偏移错位
+    if (iph->frag_off & bpf_htons(IP_FRAG_MASK)) return count(skb, STAT_NOT_TCP);
+
+    __u32 ip_hdr_len = iph->ihl * 4;
+    if (ip_hdr_len < sizeof(*iph)) return count(skb, STAT_TRUNCATED);
+
+    struct inject_ctx ctx = {
+        .l4_off      = l3_off + ip_hdr_len,
+        .l3_len_off  = l3_off + offsetof(struct iphdr, tot_len),
+        .l3_csum_off = l3_off + offsetof(struct iphdr, check),
+        .l3_end      = l3_off + bpf_ntohs(iph->tot_len),
+        .l3_len      = iph->tot_len,
+        .ipv4        = true,
+        .tun         = *tun,
+    };
+    const __u32 source_ip = iph->saddr;
+
+    enum stat_reason reason;
+    struct tcphdr *tcph = parse_tcp(data, data_end, &ctx, &reason);
+    if (!tcph) return count(skb, reason);
+
+    if (policy_enabled) {
+        struct policy_key key = { .addr = { [10] = 0xff, [11] = 0xff } };
+        __builtin_memcpy(&key.addr[12], &iph->daddr, sizeof(iph->daddr));
+        if (!policy_allows(&key, tcph->dest)) return count(skb, STAT_POLICY_SKIPPED);
+    }
+
+    struct client_addr *c = proxy_client(skb);
+    if (c) return inject_client(skb, &ctx, c);
+
+    // 内层连接的 conntrack 在 Pod 的网络命名空间中，underlay 网卡上查不到
+    if (ct_lookup && !tun->present) {
+        struct bpf_sock_tuple tuple = { .ipv4 = {
+            .saddr = iph->daddr, .daddr = source_ip, .sport = tcph->dest, .dport = tcph->source,
+        } };
+        struct client_addr orig = {};
+        if (ct_original_source(skb, &tuple, sizeof(tuple.ipv4), true, &orig)) return inject_client(skb, &ctx, &orig);
+    }
+
+    struct toa_data opt = { .kind = toa_kind, .len = sizeof(opt), .port = tcph->source, .ip = source_ip };
+    return inject(skb, &ctx, &opt, sizeof(opt));
+}
+
+static __always_inline bool ipv6_is_exthdr(__u8 nexthdr)
+{
+    return nexthdr == IPPROTO_HOPOPTS || nexthdr == IPPROTO_ROUTING || nexthdr == IPPROTO_DSTOPTS ||
+           nexthdr == IPPROTO_AH || nexthdr == IPPROTO_FRAGMENT;
+}
+
+// ipv6_skip_exthdrs 从 *off 开始跳过扩展头，成功时 *off 指向 TCP 头。
+// 分片报文 (非首片或带 MF) 不处理
+static __always_inline int ipv6_skip_exthdrs(void *data, void *data_end, __u32 *off, __u8 nexthdr)
+{
+    for (int i = 0; i < IPV6_MAX_EXT_HDRS; i++) {
+        switch (nexthdr) {
+        case IPPROTO_TCP:
+            return 0;
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS: {
+            struct ipv6_opt_hdr *oh = data + *off;
+            if ((void *)oh + sizeof(*oh) > data_end) return -1;
+            nexthdr = oh->nexthdr;
+            *off += (oh->hdrlen + 1) * 8;
+            break;
+        }
+        case IPPROTO_AH: {
+            struct ipv6_opt_hdr *oh = data + *off;
+            if ((void *)oh + sizeof(*oh) > data_end) return -1;
+            nexthdr = oh->nexthdr;
+            *off += (oh->hdrlen + 2) * 4;
+            break;
+        }
+        case IPPROTO_FRAGMENT: {
+            struct ipv6_frag_hdr *fh = data + *off;
+            if ((void *)fh + sizeof(*fh) > data_end) return -1;
+            if (fh->frag_off & bpf_htons(IPV6_FRAG_OFFSET_MF)) return -1;
+            nexthdr = fh->nexthdr;
+            *off += sizeof(*fh);
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static __always_inline int handle_ipv6(struct __sk_buff *skb, const __u32 l3_off, const struct tunnel_ctx *tun)
+{
+    void *data_end = (void *)(long)skb->data_end;
+    void *data     = (void *)(long)skb->data;
+
+    struct ipv6hdr *ip6h = data + l3_off;
+    if ((void *)ip6h + sizeof(*ip6h) > data_end) return count(skb, STAT_TRUNCATED);
+
+    struct inject_ctx ctx = {
+        .l4_off     = l3_off + sizeof(*ip6h),
+        .l3_len_off = l3_off + offsetof(struct ipv6hdr, payload_len),
+        .l3_end     = l3_off + sizeof(*ip6h) + bpf_ntohs(ip6h->payload_len),
+        .l3_len     = ip6h->payload_len,
+        .tun        = *tun,
+    };
+
+    struct toa_data_v6 opt = { .kind = toa_kind_v6, .len = sizeof(opt) };
+    __builtin_memcpy(opt.ip, &ip6h->saddr, sizeof(opt.ip));
+
+    __u8 nexthdr = ip6h->nexthdr;
+    if (nexthdr != IPPROTO_TCP && !ipv6_is_exthdr(nexthdr)) return count(skb, STAT_NOT_TCP);
+    if (ipv6_skip_exthdrs(data, data_end, &ctx.l4_off, nexthdr) < 0) return count(skb, STAT_IPV6_EXTHDR);
+
+    enum stat_reason reason;
+    struct tcphdr *tcph = parse_tcp(data, data_end, &ctx, &reason);
+    if (!tcph) return count(skb, reason);
+
+    if (policy_enabled) {
+        struct policy_key key = {};
+        __builtin_memcpy(key.addr, &ip6h->daddr, sizeof(key.addr));
+        if (!policy_allows(&key, tcph->dest)) return count(skb, STAT_POLICY_SKIPPED);
+    }
+
+    struct client_addr *c = proxy_client(skb);
+    if (c) return inject_client(skb, &ctx, c);
+
+    if (ct_lookup && !tun->present) {
+        struct bpf_sock_tuple tuple = { .ipv6 = { .sport = tcph->dest, .dport = tcph->source } };
+        __builtin_memcpy(tuple.ipv6.saddr, &ip6h->daddr, sizeof(tuple.ipv6.saddr));
+        __builtin_memcpy(tuple.ipv6.daddr, &ip6h->saddr, sizeof(tuple.ipv6.daddr));
+        struct client_addr orig = {};
+        if (ct_original_source(skb, &tuple, sizeof(tuple.ipv6), false, &orig)) return inject_client(skb, &ctx, &orig);
+    }
+
+    opt.port = tcph->source;
+    return inject(skb, &ctx, &opt, sizeof(opt));
+}
+
+// VLAN 标签 (802.1Q/802.1ad)。网卡或协议栈已经把标签剥离到 skb->vlan_tci 时报文中不再有这一层，
+// 例如 TC ingress 上的外层标签；没有硬件卸载的 trunk 网卡 egress 和 XDP 看到的是完整的标签
+#define VLAN_MAX_DEPTH 2
+
+struct vlan_hdr {
+    __be16 h_vlan_TCI;
+    __be16 h_vlan_encapsulated_proto;
+};
+
+static __always_inline bool is_vlan_proto(__be16 proto)
+{
+    return proto == bpf_htons(ETH_P_8021Q) || proto == bpf_htons(ETH_P_8021AD);
+}
+
+// parse_l2 跳过以太网头和最多两层 VLAN 标签，返回 L3 偏移，*proto 为 L3 协议。
+// 失败时返回负数，*reason 为跳过原因；成功时 *reason 为 VLAN 路径计数，没有标签时为 STAT_MAX
+static __always_inline int parse_l2(void *data, void *data_end, __be16 *proto, enum stat_reason *reason)
+{
+    struct ethhdr *eth = data;
+    *reason = STAT_TRUNCATED;
+    if ((void *)eth + sizeof(*eth) > data_end) return -1;
+
+    int off = sizeof(*eth);
+    *proto = eth->h_proto;
+    for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+        if (!is_vlan_proto(*proto)) break;
+        struct vlan_hdr *vh = data + off;
+        if ((void *)vh + sizeof(*vh) > data_end) return -1;
+        *proto = vh->h_vlan_encapsulated_proto;
+        off += sizeof(*vh);
+    }
+    if (is_vlan_proto(*proto)) {
+        *reason = STAT_VLAN_TOO_DEEP;
+        return -1;
+    }
+
+    switch (off) {
+    case sizeof(*eth) + sizeof(struct vlan_hdr):
+        *reason = STAT_VLAN;
+        break;
+    case sizeof(*eth) + 2 * sizeof(struct vlan_hdr):
+        *reason = STAT_QINQ;
+        break;
+    default:
+        *reason = STAT_MAX;
+    }
+    return off;
+}
+
+#ifndef ETH_P_TEB
+#define ETH_P_TEB 0x6558
+#endif
+
+#define VXLAN_HDR_LEN 8
+
+// Geneve 头 (RFC 8926)，第一个字节的低 6 位是以 4 字节为单位的选项长度
+struct geneve_hdr {
+    __u8 ver_opt_len;
+    __u8 flags;
+    __be16 protocol;
+    __u8 vni[3];
+    __u8 reserved;
+};
+
+#define GENEVE_OPT_LEN_MASK 0x3f
+
+// parse_tunnel 检查 l3_off 处的外层 IP 报文是否是 VXLAN/Geneve/IPIP/IP6IP6 封装。是时返回内层 IP 头偏移，
+// *proto 改为内层 L3 协议并填写 tun；否则返回负数，报文按外层处理。
+// 外层 IPv6 只认紧跟基本头的 UDP/IPIP，内层以太网头后不再解析 VLAN
+static __always_inline int parse_tunnel(void *data, void *data_end, __be16 *proto, const __u32 l3_off,
+                                        struct tunnel_ctx *tun)
+{
+    __u8 l4_proto;
+    __u32 off;
+
+    if (*proto == bpf_htons(ETH_P_IP)) {
+        struct iphdr *iph = data + l3_off;
+        if ((void *)iph + sizeof(*iph) > data_end || iph->ihl < 5) return -1;
+        // 分片的外层报文中内层头部不完整
+        if (iph->frag_off & bpf_htons(IP_FRAG_MASK)) return -1;
+        l4_proto = iph->protocol;
+        off = l3_off + iph->ihl * 4;
+        tun->outer_ipv4     = true;
+        tun->outer_len_off  = l3_off + offsetof(struct iphdr, tot_len);
+        tun->outer_csum_off = l3_off + offsetof(struct iphdr, check);
+        tun->outer_len      = iph->tot_len;
+    } else if (enable_ipv6 && *proto == bpf_htons(ETH_P_IPV6)) {
+        struct ipv6hdr *ip6h = data + l3_off;
+        if ((void *)ip6h + sizeof(*ip6h) > data_end) return -1;
+        l4_proto = ip6h->nexthdr;
+        off = l3_off + sizeof(*ip6h);
+        tun->outer_ipv4    = false;
+        tun->outer_len_off = l3_off + offsetof(struct ipv6hdr, payload_len);
+        tun->outer_len     = ip6h->payload_len;
+    } else {
+        return -1;
+    }
+
+    switch (l4_proto) {
+    case IPPROTO_IPIP:
+        *proto = bpf_htons(ETH_P_IP);
+        break;
+    case IPPROTO_IPV6:
+        *proto = bpf_htons(ETH_P_IPV6);
+        break;
+    case IPPROTO_UDP: {
+        struct udphdr *udph = data + off;
+        if ((void *)udph + sizeof(*udph) > data_end) return -1;
+        tun->udp_off = off;
+        tun->udp_len = udph->len;
+        off += sizeof(*udph);
+
+        if (udph->dest == bpf_htons(vxlan_port)) {
+            off += VXLAN_HDR_LEN;
+        } else if (udph->dest == bpf_htons(geneve_port)) {
+            struct geneve_hdr *gh = data + off;
+            if ((void *)gh + sizeof(*gh) > data_end) return -1;
+            // 只处理承载以太网帧的 Geneve
+            if (gh->protocol != bpf_htons(ETH_P_TEB)) return -1;
+            off += sizeof(*gh) + (gh->ver_opt_len & GENEVE_OPT_LEN_MASK) * 4;
+        } else {
+            return -1;
+        }
+
+        struct ethhdr *eth = data + off;
+        if ((void *)eth + sizeof(*eth) > data_end) return -1;
+        *proto = eth->h_proto;
+        off += sizeof(*eth);
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    tun->inner_l3_off = off;
+    tun->present = true;
+    return off;
+}
+
+// tc_inject 是 egress 和 ingress 两个 TC 程序共用的注入逻辑，总是返回 TC_ACT_OK
+static __always_inline int tc_inject(struct __sk_buff *skb)
+{
+    void *data_end = (void *)(long)skb->data_end;
+    void *data     = (void *)(long)skb->data;
+
+    __be16 proto;
+    enum stat_reason path;
+    int l3_off = parse_l2(data, data_end, &proto, &path);
+    if (l3_off < 0) return count(skb, path);
+    if (path != STAT_MAX) count(skb, path);
+
+    // 隧道报文改为处理内层，外层的长度和校验和在注入后一起修正
+    struct tunnel_ctx tun = {};
+    if (enable_tunnels) {
+        int inner = parse_tunnel(data, data_end, &proto, l3_off, &tun);
+        if (inner > 0) {
+            l3_off = inner;
+            count(skb, STAT_TUNNEL);
+        }
+    }
+
+    if (proto == bpf_htons(ETH_P_IP)) {
+        return handle_ipv4(skb, l3_off, &tun);
+    }
+    if (enable_ipv6 && proto == bpf_htons(ETH_P_IPV6)) {
+        return handle_ipv6(skb, l3_off, &tun);
+    }
+    return count(skb, STAT_NOT_IP);
+}
 
 SEC("tc")
 int inject_tcp_option(struct __sk_buff *skb) {
+    return tc_inject(skb);
+}
+
+// ---------------------------------------------------------------------------
+// TC ingress 引擎: 转发网关在报文进入网卡时注入，随后用 bpf_fib_lookup 查路由并直接重定向到出口网卡，
+// SYN 和同一流后续的 TCP 报文都不再经过 netfilter 和协议栈的路由转发。
+// 邻居已解析时改写 MAC 后 bpf_redirect；未解析时交给 bpf_redirect_neigh 按下一跳解析 (内核 5.11+)。
+// 发往本机、需要分片、非 TCP 和策略未命中的报文照常交给协议栈
+// ---------------------------------------------------------------------------
+
+// ingress_redirect 关闭时只在入口注入，转发仍由协议栈完成
+volatile const bool ingress_redirect = true;
+
+#ifndef PACKET_HOST
+#define PACKET_HOST 0
+#endif
+
+// ipv4_decrease_ttl 把 TTL 减一，头校验和相应加 0x0100
+static __always_inline void ipv4_decrease_ttl(struct iphdr *iph)
+{
+    __u32 check = iph->check;
+    check += bpf_htons(0x0100);
+    iph->check = (__u16)(check + (check >= 0xffff));
+    iph->ttl--;
+}
+
+// tc_forward 为注入后的报文查路由并重定向。tot_len 为 0 时内核按 skb 检查出口 MTU，GSO 报文也能正确处理
+static __always_inline int tc_forward(struct __sk_buff *skb)
+{
     void *data_end = (void *)(long)skb->data_end;
     void *data     = (void *)(long)skb->data;
 
-    // --- 1. 初始指针和边界检查 ---
+    // 目的 MAC 不是本机的报文由协议栈丢弃。带 VLAN 标签 (包括已剥离到 vlan_tci 的) 的报文
+    // 属于 VLAN 子接口，不能原样从另一块网卡发出，也交给协议栈；报文中还有标签时 h_proto 不是 IP
+    if (skb->pkt_type != PACKET_HOST || skb->vlan_present) return TC_ACT_OK;
+
     struct ethhdr *eth = data;
     if ((void *)eth + sizeof(*eth) > data_end) return TC_ACT_OK;
 
-    struct iphdr *iph = (void *)eth + sizeof(*eth);
-    if ((void *)iph + sizeof(*iph) > data_end) return TC_ACT_OK;
+    struct bpf_fib_lookup fib = { .ifindex = skb->ingress_ifindex };
+    struct policy_key key = {};
+    struct iphdr *iph = NULL;
+    struct ipv6hdr *ip6h = NULL;
+    struct tcphdr *tcph;
 
-    if (eth->h_proto != bpf_htons(ETH_P_IP) || iph->protocol != IPPROTO_TCP) {
+    if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+        iph = (void *)(eth + 1);
+        if ((void *)iph + sizeof(*iph) > data_end || iph->ttl <= 1) return TC_ACT_OK;
+        if (iph->protocol != IPPROTO_TCP || iph->ihl < 5) return TC_ACT_OK;
+        tcph = (void *)iph + iph->ihl * 4;
+        fib.family   = AF_INET;
+        fib.tos      = iph->tos;
+        fib.ipv4_src = iph->saddr;
+        fib.ipv4_dst = iph->daddr;
+        key.addr[10] = key.addr[11] = 0xff;
+        __builtin_memcpy(&key.addr[12], &iph->daddr, sizeof(iph->daddr));
+    } else if (enable_ipv6 && eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+        ip6h = (void *)(eth + 1);
+        if ((void *)ip6h + sizeof(*ip6h) > data_end || ip6h->hop_limit <= 1) return TC_ACT_OK;
+        // 带扩展头的报文不走快路径
+        if (ip6h->nexthdr != IPPROTO_TCP) return TC_ACT_OK;
+        tcph = (void *)(ip6h + 1);
+        fib.family   = AF_INET6;
+        fib.flowinfo = *(__be32 *)ip6h & bpf_htonl(0x0fffffff);
+        __builtin_memcpy(fib.ipv6_src, &ip6h->saddr, sizeof(fib.ipv6_src));
+        __builtin_memcpy(fib.ipv6_dst, &ip6h->daddr, sizeof(fib.ipv6_dst));
+        __builtin_memcpy(key.addr, &ip6h->daddr, sizeof(key.addr));
+    } else {
         return TC_ACT_OK;
     }
+    if ((void *)tcph + sizeof(*tcph) > data_end) return TC_ACT_OK;
+    // 策略限定注入的目的地址时，只有这些流绕过协议栈
+    if (policy_enabled && !policy_allows(&key, tcph->dest)) return TC_ACT_OK;
+
+    fib.l4_protocol = IPPROTO_TCP;
+    fib.sport       = tcph->source;
+    fib.dport       = tcph->dest;
+    long rc = bpf_fib_lookup(skb, &fib, sizeof(fib), 0);
+    if (rc != BPF_FIB_LKUP_RET_SUCCESS && rc != BPF_FIB_LKUP_RET_NO_NEIGH) return TC_ACT_OK;
+
+    if (iph) ipv4_decrease_ttl(iph);
+    if (ip6h) ip6h->hop_limit--;
+    count(skb, STAT_FORWARDED);
+
+    if (rc == BPF_FIB_LKUP_RET_NO_NEIGH) {
+        // fib 把 ipv4_dst/ipv6_dst 改写成了下一跳，两者在 bpf_redir_neigh 中同样共用一段
+        struct bpf_redir_neigh nh = { .nh_family = fib.family };
+        __builtin_memcpy(nh.ipv6_nh, fib.ipv6_dst, sizeof(nh.ipv6_nh));
+        return bpf_redirect_neigh(fib.ifindex, &nh, sizeof(nh), 0);
+    }
+    __builtin_memcpy(eth->h_dest, fib.dmac, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, fib.smac, ETH_ALEN);
+    return bpf_redirect(fib.ifindex, 0);
+}
+
+SEC("tc")
+int inject_toa_ingress(struct __sk_buff *skb)
+{
+    tc_inject(skb);
+    if (!ingress_redirect) return TC_ACT_OK;
+    return tc_forward(skb);
+}
+
+// ---------------------------------------------------------------------------
+// LWT 引擎: 程序挂在去往后端网段的路由上 (ip route ... encap bpf xmit)，只有走这些路由的报文才进入程序，
+// 出口网卡上的其他流量完全不经过 BPF。xmit 阶段还没有二层头，skb->data 就是 IP 头，
+// 协议由 skb->protocol 给出，计数记在路由的出口网卡上。
+// LWT 程序不能调用 bpf_get_socket_cookie 和 conntrack kfunc，用户态不允许同时打开 -proxy-addr/-conntrack
+// ---------------------------------------------------------------------------
+
+SEC("lwt_xmit")
+int inject_toa_lwt(struct __sk_buff *skb)
+{
+    // 路由上看到的是内层报文本身，不解析隧道
+    const struct tunnel_ctx tun = {};
+
+    if (skb->protocol == bpf_htons(ETH_P_IP)) {
+        handle_ipv4(skb, 0, &tun);
+    } else if (enable_ipv6 && skb->protocol == bpf_htons(ETH_P_IPV6)) {
+        handle_ipv6(skb, 0, &tun);
+    } else {
+        count(skb, STAT_NOT_IP);
+    }
+    return BPF_OK;
+}
+
+// ---------------------------------------------------------------------------
+// XDP 引擎: 纯转发节点在驱动收包时处理经过的 SYN，不分配 skb。
+// 选项写在 TCP 头尾部: 没有负载的 SYN 用 bpf_xdp_adjust_tail 在帧尾扩出空间，头部不动；
+// 带负载的 SYN 用 bpf_xdp_adjust_head 在帧头扩出空间，把以太网/IP/TCP 头整体前移，负载留在原地。
+// 之后按 bpf_fib_lookup 的结果改写 MAC、递减 TTL，经 devmap 从出口网卡直接发出。
+// 本机不转发的报文和其他报文交给协议栈；不复用 NOP 填充 (enable_compact 只作用于 TC 引擎)
+// ---------------------------------------------------------------------------
+
+// xdp_redirect 关闭时只注入不转发，报文交给协议栈路由
+volatile const bool xdp_redirect = true;
+
+// tx_ports 是可以直接重定向的出口网卡 (key 和 value 都是 ifindex)，由用户态随挂载维护
+struct {
+    __uint(type, BPF_MAP_TYPE_DEVMAP_HASH);
+    __uint(max_entries, 1024);
+    __type(key, __u32);
+    __type(value, __u32);
+} tx_ports SEC(".maps");
+
+// 需要前移的头部 (以太网 + IP + TCP) 上限，保证复制循环有界
+#define XDP_MAX_HDR_LEN 192
+
+static __always_inline int xdp_count(struct xdp_md *ctx, enum stat_reason reason, int action)
+{
+    count_slot(ctx->ingress_ifindex, reason);
+    return action;
+}
+
+static __always_inline __u16 csum_fold(__u32 csum)
+{
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    return (__u16)~csum;
+}
+
+// csum_start 把已有的校验和展开为增量计算的初值 (RFC 1624)，结果用 csum_fold 折叠
+static __always_inline __u32 csum_start(__u16 check)
+{
+    return ~(__u32)check & 0xffff;
+}
+
+// xdp_load_options 把 TCP 选项区复制到 sc->in，供 scan_options 使用
+static __always_inline int xdp_load_options(struct xdp_md *ctx, const __u32 off, const __u32 optlen,
+                                            struct opt_scratch *sc)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    for (__u32 i = 0; i < TCP_MAX_OPT_LEN; i++) {
+        if (i >= optlen) break;
+        __u8 *p = data + off + i;
+        if ((void *)p + 1 > data_end) return -1;
+        sc->in[i & OPT_BUF_MASK] = *p;
+    }
+    return 0;
+}
+
+// xdp_overwrite 原地改写选项区 toa_off 处已有的 TOA 选项
+static __always_inline enum stat_reason xdp_overwrite(struct xdp_md *ctx, const struct inject_ctx *ic,
+                                                      struct opt_scratch *sc, const __u32 optlen, __u32 toa_off,
+                                                      const void *opt, const __u32 opt_len)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    if (toa_off > TCP_MAX_OPT_LEN - opt_len) return STAT_BAD_OPTIONS;
+    __builtin_memcpy(sc->out, sc->in, TCP_MAX_OPT_LEN);
+    __builtin_memcpy(sc->out + toa_off, opt, opt_len);
+
+    struct tcphdr *tcph = data + ic->l4_off;
+    if ((void *)tcph + sizeof(*tcph) > data_end) return STAT_TRUNCATED;
+    __u8 *p = (void *)tcph + sizeof(*tcph) + toa_off;
+    if ((void *)p + opt_len > data_end) return STAT_TRUNCATED;
+
+    const __s64 sum = bpf_csum_diff((void *)sc->in, optlen, (void *)sc->out, optlen, csum_start(tcph->check));
+    if (sum < 0) return STAT_CSUM_FAILED;
+    __builtin_memcpy(p, opt, opt_len);
+    tcph->check = csum_fold(sum);
+    return STAT_EXISTING_REWRITTEN;
+}
+
+// xdp_move_headers 在 bpf_xdp_adjust_head 之后把 hdr_len 字节的头部从 opt_len 处移到帧首。
+// 头部长度总是偶数 (14 + 4n)，按 2 字节复制
+static __always_inline int xdp_move_headers(struct xdp_md *ctx, const __u32 hdr_len, const __u32 opt_len)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    for (__u32 i = 0; i < XDP_MAX_HDR_LEN; i += 2) {
+        if (i >= hdr_len) break;
+        __u8 *dst = data + i;
+        __u8 *src = dst + opt_len;
+        if ((void *)src + 2 > data_end) return -1;
+        __builtin_memcpy(dst, src, 2);
+    }
+    return 0;
+}
+
+// xdp_inject 在 l3_off 处的 SYN 中写入 opt，返回出口原因。
+// 帧长改变之后原来的报文指针全部失效，之后的写入都按偏移重新取指针
+static __always_inline enum stat_reason xdp_inject(struct xdp_md *ctx, const struct inject_ctx *ic, const __u32 l3_off,
+                                                   const void *opt, const __u32 opt_len)
+{
+    const __u32 hdr_len = ic->l4_off + ic->tcp_hdr_len;
+    if (ic->l3_end < hdr_len) return STAT_TRUNCATED;
+    if (ic->tcp_hdr_len + opt_len > TCP_MAX_HDR_LEN || hdr_len > XDP_MAX_HDR_LEN) return STAT_NO_ROOM;
+
+    const __u32 optlen = ic->tcp_hdr_len - sizeof(struct tcphdr);
+    if (existing_toa_mode != EXISTING_TOA_IGNORE && optlen >= opt_len && optlen <= TCP_MAX_OPT_LEN) {
+        __u32 zero = 0;
+        struct opt_scratch *sc = bpf_map_lookup_elem(&scratch, &zero);
+        if (!sc) return STAT_STORE_FAILED;
+        if (xdp_load_options(ctx, ic->l4_off + sizeof(struct tcphdr), optlen, sc) < 0) return STAT_TRUNCATED;
+
+        struct opt_scan scan;
+        if (scan_options(sc, optlen, *(const __u8 *)opt, opt_len, &scan) < 0) return STAT_BAD_OPTIONS;
+        if (scan.toa_off >= 0) {
+            if (existing_toa_mode != EXISTING_TOA_OVERWRITE) return STAT_EXISTING_SKIPPED;
+            return xdp_overwrite(ctx, ic, sc, optlen, scan.toa_off, opt, opt_len);
+        }
+    }
+
+    if (ic->l3_end == hdr_len) {
+        // 没有负载: 帧尾正好 (或加上以太网填充) 是 TCP 头结尾，一次调整同时去掉填充
+        const int delta = (int)(hdr_len + opt_len) - (int)(ctx->data_end - ctx->data);
+        if (delta != 0 && bpf_xdp_adjust_tail(ctx, delta) < 0) return STAT_GROW_FAILED;
+    } else {
+        if (bpf_xdp_adjust_head(ctx, -(int)opt_len) < 0) return STAT_GROW_FAILED;
+        if (xdp_move_headers(ctx, hdr_len, opt_len) < 0) return STAT_TRUNCATED;
+    }
+
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    struct tcphdr *tcph = data + ic->l4_off;
+    if ((void *)tcph + sizeof(*tcph) > data_end) return STAT_TRUNCATED;
+    void *dst = data + hdr_len;
+    if (dst + opt_len > data_end) return STAT_TRUNCATED;
+    __builtin_memcpy(dst, opt, opt_len);
+
+    // TCP 校验和: 新选项字节、doff 所在的 4 字节字、伪首部中的 TCP 长度
+    __be32 *doff_word = (void *)tcph + TCP_DOFF_OFF;
+    const __be32 old_word = *doff_word;
+    *(__u8 *)doff_word += (opt_len / 4) << 4;
+    const __be32 new_word = *doff_word;
+    const __be32 old_len = bpf_htonl(ic->l3_end - ic->l4_off);
+    const __be32 new_len = bpf_htonl(ic->l3_end - ic->l4_off + opt_len);
+
+    __s64 sum = bpf_csum_diff(NULL, 0, (void *)opt, opt_len, csum_start(tcph->check));
+    if (sum >= 0) sum = bpf_csum_diff((void *)&old_word, sizeof(old_word), (void *)&new_word, sizeof(new_word), sum);
+    if (sum >= 0) sum = bpf_csum_diff((void *)&old_len, sizeof(old_len), (void *)&new_len, sizeof(new_len), sum);
+    if (sum < 0) return STAT_CSUM_FAILED;
+    tcph->check = csum_fold(sum);
+
+    if (ic->ipv4) {
+        struct iphdr *iph = data + l3_off;
+        if ((void *)iph + sizeof(*iph) > data_end) return STAT_TRUNCATED;
+        // tot_len 与 version/ihl/tos 同在首个 4 字节字中
+        const __be32 old_first = *(__be32 *)iph;
+        iph->tot_len = bpf_htons(bpf_ntohs(iph->tot_len) + opt_len);
+        const __be32 new_first = *(__be32 *)iph;
+        sum = bpf_csum_diff((void *)&old_first, sizeof(old_first), (void *)&new_first, sizeof(new_first), csum_start(iph->check));
+        if (sum < 0) return STAT_CSUM_FAILED;
+        iph->check = csum_fold(sum);
+    } else {
+        struct ipv6hdr *ip6h = data + l3_off;
+        if ((void *)ip6h + sizeof(*ip6h) > data_end) return STAT_TRUNCATED;
+        ip6h->payload_len = bpf_htons(bpf_ntohs(ip6h->payload_len) + opt_len);
+    }
+    return STAT_INJECTED_XDP;
+}
+
+// xdp_fib 为报文查路由。tot_len 是注入之后的 L3 长度，路由 MTU 放不下时同样交给协议栈
+static __always_inline long xdp_fib(struct xdp_md *ctx, struct bpf_fib_lookup *fib)
+{
+    fib->l4_protocol = IPPROTO_TCP;
+    fib->ifindex = ctx->ingress_ifindex;
+    return bpf_fib_lookup(ctx, fib, sizeof(*fib), 0);
+}
+
+// xdp_forward 在注入之后决定报文的去向。rc 为负表示没有查路由 (关闭了重定向或带 VLAN 标签)，直接交给协议栈；
+// 否则按路由结果改写 MAC、递减 TTL，经 devmap 从出口网卡发出。查到了路由却交给协议栈的报文
+// 按原因记一次路径计数，与注入结果分别计数
+static __always_inline int xdp_forward(struct xdp_md *ctx, struct bpf_fib_lookup *fib, const long rc,
+                                       const __u32 l3_off, const bool ipv4)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    if (rc < 0) return XDP_PASS;
+    // 邻居表项还没有建立时由协议栈解析并转发
+    if (rc == BPF_FIB_LKUP_RET_NO_NEIGH) return xdp_count(ctx, STAT_FWD_NO_NEIGH, XDP_PASS);
+    if (!bpf_map_lookup_elem(&tx_ports, &fib->ifindex)) return xdp_count(ctx, STAT_FWD_NO_TX_PORT, XDP_PASS);
+
+    struct ethhdr *eth = data;
+    if ((void *)eth + sizeof(*eth) > data_end) return xdp_count(ctx, STAT_FWD_TRUNCATED, XDP_PASS);
+    if (ipv4) {
+        struct iphdr *iph = data + l3_off;
+        if ((void *)iph + sizeof(*iph) > data_end) return xdp_count(ctx, STAT_FWD_TRUNCATED, XDP_PASS);
+        if (iph->ttl <= 1) return xdp_count(ctx, STAT_FWD_TTL, XDP_PASS);
+        ipv4_decrease_ttl(iph);
+    } else {
+        struct ipv6hdr *ip6h = data + l3_off;
+        if ((void *)ip6h + sizeof(*ip6h) > data_end) return xdp_count(ctx, STAT_FWD_TRUNCATED, XDP_PASS);
+        if (ip6h->hop_limit <= 1) return xdp_count(ctx, STAT_FWD_TTL, XDP_PASS);
+        ip6h->hop_limit--;
+    }
+    __builtin_memcpy(eth->h_dest, fib->dmac, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, fib->smac, ETH_ALEN);
+    return bpf_redirect_map(&tx_ports, fib->ifindex, 0);
+}
+
+static __always_inline int xdp_ipv4(struct xdp_md *ctx, const __u32 l3_off)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    struct iphdr *iph = data + l3_off;
+    if ((void *)iph + sizeof(*iph) > data_end) return xdp_count(ctx, STAT_TRUNCATED, XDP_PASS);
+    if (iph->protocol != IPPROTO_TCP) return xdp_count(ctx, STAT_NOT_TCP, XDP_PASS);
+    if (iph->frag_off & bpf_htons(IP_FRAG_MASK)) return xdp_count(ctx, STAT_NOT_TCP, XDP_PASS);
 
     __u32 ip_hdr_len = iph->ihl * 4;
-    if (ip_hdr_len < sizeof(*iph)) return TC_ACT_OK;
+    if (ip_hdr_len < sizeof(*iph)) return xdp_count(ctx, STAT_TRUNCATED, XDP_PASS);
 
-    struct tcphdr *tcph = (void *)iph + ip_hdr_len;
-    if ((void *)tcph + sizeof(*tcph) > data_end) return TC_ACT_OK;
+    struct inject_ctx ic = {
+        .l4_off = l3_off + ip_hdr_len,
+        .l3_end = l3_off + bpf_ntohs(iph->tot_len),
+        .ipv4   = true,
+    };
 
-    if (!tcph->syn) return TC_ACT_OK;
+    enum stat_reason reason;
+    struct tcphdr *tcph = parse_tcp(data, data_end, &ic, &reason);
+    if (!tcph) return xdp_count(ctx, reason, XDP_PASS);
 
-    __u32 old_tcp_hdr_len = tcph->doff * 4;
-    if (old_tcp_hdr_len < sizeof(*tcph)) return TC_ACT_OK;
-    if (old_tcp_hdr_len + sizeof(struct toa_data) > 60) return TC_ACT_OK;
+    if (policy_enabled) {
+        struct policy_key key = { .addr = { [10] = 0xff, [11] = 0xff } };
+        __builtin_memcpy(&key.addr[12], &iph->daddr, sizeof(iph->daddr));
+        if (!policy_allows(&key, tcph->dest)) return xdp_count(ctx, STAT_POLICY_SKIPPED, XDP_PASS);
+    }
 
-    // --- 2. 【读取阶段】---
-    const __u16 source_port = tcph->source;
-    const __u32 source_ip   = iph->saddr;
-    const __be16 old_tot_len_be = iph->tot_len;
+    struct toa_data opt = { .kind = toa_kind, .len = sizeof(opt), .port = tcph->source, .ip = iph->saddr };
+    struct bpf_fib_lookup fib = {
+        .family   = AF_INET,
+        .tos      = iph->tos,
+        .tot_len  = bpf_ntohs(iph->tot_len) + sizeof(opt),
+        .ipv4_src = iph->saddr,
+        .ipv4_dst = iph->daddr,
+    };
+    long rc = -1;
+    // 带 VLAN 标签的帧只注入，由协议栈交给 VLAN 子接口
+    if (xdp_redirect && l3_off == sizeof(struct ethhdr)) {
+        rc = xdp_fib(ctx, &fib);
+        if (rc != BPF_FIB_LKUP_RET_SUCCESS && rc != BPF_FIB_LKUP_RET_NO_NEIGH) {
+            return xdp_count(ctx, STAT_NOT_FORWARDED, XDP_PASS);
+        }
+    }
 
-    const int doff_flags_offset = sizeof(*eth) + ip_hdr_len + 12;
-    __be16 old_doff_flags_word_be;
-    if (bpf_skb_load_bytes(skb, doff_flags_offset, &old_doff_flags_word_be, sizeof(old_doff_flags_word_be)) < 0) {
-        return TC_ACT_OK;
+    count_slot(ctx->ingress_ifindex, xdp_inject(ctx, &ic, l3_off, &opt, sizeof(opt)));
+    return xdp_forward(ctx, &fib, rc, l3_off, true);
+}
+
+static __always_inline int xdp_ipv6(struct xdp_md *ctx, const __u32 l3_off)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    struct ipv6hdr *ip6h = data + l3_off;
+    if ((void *)ip6h + sizeof(*ip6h) > data_end) return xdp_count(ctx, STAT_TRUNCATED, XDP_PASS);
+
+    struct inject_ctx ic = {
+        .l4_off = l3_off + sizeof(*ip6h),
+        .l3_end = l3_off + sizeof(*ip6h) + bpf_ntohs(ip6h->payload_len),
+    };
+
+    __u8 nexthdr = ip6h->nexthdr;
+    if (nexthdr != IPPROTO_TCP && !ipv6_is_exthdr(nexthdr)) return xdp_count(ctx, STAT_NOT_TCP, XDP_PASS);
+    if (ipv6_skip_exthdrs(data, data_end, &ic.l4_off, nexthdr) < 0) return xdp_count(ctx, STAT_IPV6_EXTHDR, XDP_PASS);
+
+    enum stat_reason reason;
+    struct tcphdr *tcph = parse_tcp(data, data_end, &ic, &reason);
+    if (!tcph) return xdp_count(ctx, reason, XDP_PASS);
+
+    if (policy_enabled) {
+        struct policy_key key = {};
+        __builtin_memcpy(key.addr, &ip6h->daddr, sizeof(key.addr));
+        if (!policy_allows(&key, tcph->dest)) return xdp_count(ctx, STAT_POLICY_SKIPPED, XDP_PASS);
     }
 
-    // --- 3. 【计算阶段】---
-    const __u16 old_doff_flags_word_host = bpf_ntohs(old_doff_flags_word_be);
-    const __u8 old_doff_val = (old_doff_flags_word_host >> 12);
-    const __u8 new_doff_val = old_doff_val + (sizeof(struct toa_data) / 4);
-    const __u16 new_doff_flags_word_host = (old_doff_flags_word_host & 0x0FFF) | (new_doff_val << 12);
-    const __be16 new_doff_flags_word_be = bpf_htons(new_doff_flags_word_host);
-    const __be16 new_tot_len_be = bpf_htons(bpf_ntohs(old_tot_len_be) + sizeof(struct toa_data));
+    struct toa_data_v6 opt = { .kind = toa_kind_v6, .len = sizeof(opt), .port = tcph->source };
+    __builtin_memcpy(opt.ip, &ip6h->saddr, sizeof(opt.ip));
+    struct bpf_fib_lookup fib = {
+        .family   = AF_INET6,
+        .flowinfo = *(__be32 *)ip6h & bpf_htonl(0x0fffffff),
+        .tot_len  = sizeof(*ip6h) + bpf_ntohs(ip6h->payload_len) + sizeof(opt),
+    };
+    __builtin_memcpy(fib.ipv6_src, &ip6h->saddr, sizeof(fib.ipv6_src));
+    __builtin_memcpy(fib.ipv6_dst, &ip6h->daddr, sizeof(fib.ipv6_dst));
+    long rc = -1;
+    if (xdp_redirect && l3_off == sizeof(struct ethhdr)) {
+        rc = xdp_fib(ctx, &fib);
+        if (rc != BPF_FIB_LKUP_RET_SUCCESS && rc != BPF_FIB_LKUP_RET_NO_NEIGH) {
+            return xdp_count(ctx, STAT_NOT_FORWARDED, XDP_PASS);
+        }
+    }
 
-    // --- 4. 【写入阶段】---
-    if (bpf_skb_adjust_room(skb, sizeof(struct toa_data), BPF_ADJ_ROOM_NET, 0) < 0) {
-        return TC_ACT_OK;
+    count_slot(ctx->ingress_ifindex, xdp_inject(ctx, &ic, l3_off, &opt, sizeof(opt)));
+    return xdp_forward(ctx, &fib, rc, l3_off, false);
+}
+
+SEC("xdp")
+int inject_toa_xdp(struct xdp_md *ctx)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data     = (void *)(long)ctx->data;
+
+    __be16 proto;
+    enum stat_reason path;
+    int l3_off = parse_l2(data, data_end, &proto, &path);
+    if (l3_off < 0) return xdp_count(ctx, path, XDP_PASS);
+    if (path != STAT_MAX) count_slot(ctx->ingress_ifindex, path);
+
+    if (proto == bpf_htons(ETH_P_IP)) {
+        return xdp_ipv4(ctx, l3_off);
+    }
+    if (enable_ipv6 && proto == bpf_htons(ETH_P_IPV6)) {
+        return xdp_ipv6(ctx, l3_off);
     }
+    return xdp_count(ctx, STAT_NOT_IP, XDP_PASS);
+}
 
-    // --- 重新加载所有指针 ---
-    data_end = (void *)(long)skb->data_end;
-    data     = (void *)(long)skb->data;
-    eth      = data;
-    if ((void *)eth + sizeof(*eth) > data_end) return TC_ACT_OK;
-    iph      = (void *)eth + sizeof(*eth);
-    if ((void *)iph + sizeof(*iph) > data_end) return TC_ACT_OK;
-    __u32 new_ip_hdr_len = iph->ihl * 4;
-    if (new_ip_hdr_len < sizeof(*iph)) return TC_ACT_OK;
-
-    // a. 写入新的 TCP 选项
-    struct toa_data opt = { .kind = 254, .len = sizeof(opt), .port = source_port, .ip = source_ip };
-    if (bpf_skb_store_bytes(skb, sizeof(*eth) + new_ip_hdr_len + old_tcp_hdr_len, &opt, sizeof(opt), 0) < 0) {
-        return TC_ACT_OK;
+// ---------------------------------------------------------------------------
+// sockops 引擎: 由内核在构造 SYN 时预留并写入 TOA 选项，不需要改变 skb 大小、
+// 搬移头部或修正校验和，选项空间不足时内核直接拒绝预留。
+// 只作用于挂载 cgroup 内本机发起的连接；sockops 上下文没有网卡信息，计数记在 0 号槽位
+// ---------------------------------------------------------------------------
+
+#define TCPHDR_SYN 0x02
+#define TCPHDR_ACK 0x10
+
+#define SOCKOPS_SLOT 0
+
+// sockops_ipv4 判断连接是否走 IPv4，包括 v4-mapped 地址的 IPv6 socket
+static __always_inline bool sockops_ipv4(const struct bpf_sock_ops *skops)
+{
+    if (skops->family == AF_INET) return true;
+    return skops->remote_ip6[0] == 0 && skops->remote_ip6[1] == 0 &&
+           skops->remote_ip6[2] == bpf_htonl(0x0000ffff);
+}
+
+// sockops_wants 在连接发起时判断是否需要为它写入选项
+static __always_inline bool sockops_wants(const struct bpf_sock_ops *skops)
+{
+    if (skops->family != AF_INET && skops->family != AF_INET6) return false;
+
+    const bool ipv4 = sockops_ipv4(skops);
+    if (!ipv4 && !enable_ipv6) return false;
+
+    if (policy_enabled) {
+        struct policy_key key = { .addr = { [10] = 0xff, [11] = 0xff } };
+        if (ipv4) {
+            __u32 daddr = skops->remote_ip4;
+            __builtin_memcpy(&key.addr[12], &daddr, sizeof(daddr));
+        } else {
+            __u32 daddr[4] = { skops->remote_ip6[0], skops->remote_ip6[1],
+                               skops->remote_ip6[2], skops->remote_ip6[3] };
+            __builtin_memcpy(key.addr, daddr, sizeof(key.addr));
+        }
+        // remote_port 以网络字节序存放在高 16 位
+        const __be16 dport = bpf_htons((__u16)bpf_ntohl(skops->remote_port));
+        if (!policy_allows(&key, dport)) {
+            count_slot(SOCKOPS_SLOT, STAT_POLICY_SKIPPED);
+            return false;
+        }
     }
+    return true;
+}
 
-    // b. 更新 IP 总长度 (L3)
-    if (bpf_skb_store_bytes(skb, sizeof(*eth) + offsetof(struct iphdr, tot_len), &new_tot_len_be, sizeof(new_tot_len_be), 0) < 0) {
-        return TC_ACT_OK;
+// sockops_is_syn 判断当前回调对应的报文是否是主动连接的 SYN (含重传)
+static __always_inline bool sockops_is_syn(const struct bpf_sock_ops *skops)
+{
+    return (skops->skb_tcp_flags & (TCPHDR_SYN | TCPHDR_ACK)) == TCPHDR_SYN;
+}
+
+// sockops_client 返回代理为本连接设置的客户端地址
+static __always_inline struct client_addr *sockops_client(struct bpf_sock_ops *skops)
+{
+    if (!proxy_addr) return NULL;
+
+    struct bpf_sock *sk = skops->sk;
+    if (!sk) return NULL;
+    return bpf_sk_storage_get(&proxy_clients, sk, 0, 0);
+}
+
+static __always_inline int sockops_store(struct bpf_sock_ops *skops, const void *opt, const __u32 opt_len)
+{
+    const long ret = bpf_store_hdr_opt(skops, opt, opt_len, 0);
+    if (ret == -28 /* ENOSPC，HDR_OPT_LEN_CB 预留失败 */) {
+        count_slot(SOCKOPS_SLOT, STAT_NO_ROOM);
+    } else if (ret < 0) {
+        count_slot(SOCKOPS_SLOT, STAT_STORE_FAILED);
+    } else {
+        count_slot(SOCKOPS_SLOT, STAT_INJECTED_SOCKOPS);
     }
+    return 1;
+}
 
-    // c. 更新 TCP 数据偏移 (L4), 并请求内核重算 TCP 校验和
-    if (bpf_skb_store_bytes(skb, sizeof(*eth) + new_ip_hdr_len + 12, &new_doff_flags_word_be, sizeof(new_doff_flags_word_be), BPF_F_RECOMPUTE_CSUM) < 0) {
-        return TC_ACT_OK;
+static __always_inline int sockops_store_client(struct bpf_sock_ops *skops, const struct client_addr *c)
+{
+    if (c->family == AF_INET) {
+        struct toa_data opt = { .kind = toa_kind, .len = sizeof(opt), .port = c->port };
+        __builtin_memcpy(&opt.ip, &c->addr[12], sizeof(opt.ip));
+        return sockops_store(skops, &opt, sizeof(opt));
     }
+    struct toa_data_v6 opt = { .kind = toa_kind_v6, .len = sizeof(opt), .port = c->port };
+    __builtin_memcpy(opt.ip, c->addr, sizeof(opt.ip));
+    return sockops_store(skops, &opt, sizeof(opt));
+}
 
-    return TC_ACT_OK;
+SEC("sockops")
+int inject_toa_sockops(struct bpf_sock_ops *skops)
+{
+    struct client_addr *c;
+
+    switch (skops->op) {
+    case BPF_SOCK_OPS_TCP_CONNECT_CB:
+        // 主动连接即将发送 SYN，只为需要注入的连接打开写选项回调
+        if (sockops_wants(skops)) {
+            bpf_sock_ops_cb_flags_set(skops, skops->bpf_sock_ops_cb_flags | BPF_SOCK_OPS_WRITE_HDR_OPT_CB_FLAG);
+        }
+        break;
+
+    case BPF_SOCK_OPS_HDR_OPT_LEN_CB: {
+        if (!sockops_is_syn(skops)) break;
+        c = sockops_client(skops);
+        const bool opt_v4 = c ? c->family == AF_INET : sockops_ipv4(skops);
+        bpf_reserve_hdr_opt(skops, opt_v4 ? sizeof(struct toa_data) : sizeof(struct toa_data_v6), 0);
+        break;
+    }
+
+    case BPF_SOCK_OPS_WRITE_HDR_OPT_CB:
+        if (!sockops_is_syn(skops)) break;
+        c = sockops_client(skops);
+        if (c) return sockops_store_client(skops, c);
+        // local_port 是主机字节序
+        if (sockops_ipv4(skops)) {
+            struct toa_data opt = {
+                .kind = toa_kind, .len = sizeof(opt),
+                .port = bpf_htons(skops->local_port), .ip = skops->local_ip4,
+            };
+            return sockops_store(skops, &opt, sizeof(opt));
+        } else {
+            struct toa_data_v6 opt = { .kind = toa_kind_v6, .len = sizeof(opt), .port = bpf_htons(skops->local_port) };
+            __u32 saddr[4] = { skops->local_ip6[0], skops->local_ip6[1], skops->local_ip6[2], skops->local_ip6[3] };
+            __builtin_memcpy(opt.ip, saddr, sizeof(opt.ip));
+            return sockops_store(skops, &opt, sizeof(opt));
+        }
+
+    case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+        // 握手完成后关闭回调，之后的报文不再进入本程序
+        if (skops->bpf_sock_ops_cb_flags & BPF_SOCK_OPS_WRITE_HDR_OPT_CB_FLAG) {
+            bpf_sock_ops_cb_flags_set(skops, skops->bpf_sock_ops_cb_flags & ~BPF_SOCK_OPS_WRITE_HDR_OPT_CB_FLAG);
+        }
+        break;
+    }
+    return 1;
+}
+
+// proxy_addr_sockops 只在 TC 引擎下挂载: 发送 SYN 之前 (TCP_CONNECT_CB) 把 socket 存储中的
+// 客户端地址按 cookie 复制到 proxy_cookies，供 TC 程序查找；连接建立后不再有 SYN，删除条目
+SEC("sockops")
+int proxy_addr_sockops(struct bpf_sock_ops *skops)
+{
+    struct bpf_sock *sk = skops->sk;
+    struct client_addr *c;
+    __u64 cookie;
+
+    if (!sk) return 1;
+    switch (skops->op) {
+    case BPF_SOCK_OPS_TCP_CONNECT_CB:
+        c = bpf_sk_storage_get(&proxy_clients, sk, 0, 0);
+        if (!c) break;
+        cookie = bpf_get_socket_cookie(skops);
+        bpf_map_update_elem(&proxy_cookies, &cookie, c, BPF_ANY);
+        break;
+
+    case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+        cookie = bpf_get_socket_cookie(skops);
+        bpf_map_delete_elem(&proxy_cookies, &cookie);
+        break;
+    }
+    return 1;
+}
+
+#define PAGE_SIZE 4096
+
+// set_client_addr 处理代理的 setsockopt(IPPROTO_TCP, toa_sockopt, &struct client_addr, 20)。
+// 选项由本程序处理后不再交给内核；其他选项原样交给内核
+SEC("cgroup/setsockopt")
+int set_client_addr(struct bpf_sockopt *ctx)
+{
+    void *optval = ctx->optval;
+    void *optval_end = ctx->optval_end;
+    struct bpf_sock *sk = ctx->sk;
+    struct client_addr addr, *st;
+
+    if (ctx->level != IPPROTO_TCP || ctx->optname != (int)toa_sockopt) {
+        // optlen 超过一页时程序只能看到前一页，置 0 表示不改动
+        if (ctx->optlen > PAGE_SIZE) ctx->optlen = 0;
+        return 1;
+    }
+
+    // 返回 0 时 setsockopt 以 EPERM 失败
+    if (!sk || optval + sizeof(addr) > optval_end) return 0;
+    __builtin_memcpy(&addr, optval, sizeof(addr));
+    if (addr.family != AF_INET && addr.family != AF_INET6) return 0;
+
+    st = bpf_sk_storage_get(&proxy_clients, sk, 0, BPF_SK_STORAGE_GET_F_CREATE);
+    if (!st) return 0;
+    *st = addr;
+    ctx->optlen = -1;
+    return 1;
 }
@@ -0,0 +1,222 @@
+//go:build ignore
+
+// 接收端: 从被动建立的连接的 SYN 中取出 TOA 选项，把真实客户端地址存进 socket 本地存储，
+// 取代内核模块。应用拿到地址有三种方式: getpeername() 直接返回真实客户端 (不需要改代码)、
+// getsockopt(IPPROTO_TCP, toa_sockopt) 取 struct toa_addr，或者用 socket fd 查询固定的 toa_storage map
+
+#include <linux/bpf.h>
+#include <linux/types.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <stdbool.h>
+
+char __license[] SEC("license") = "GPL";
+
+// 选项 kind 由用户态在加载前通过 RewriteConstants 改写，需要与发送端一致
+volatile const __u8 toa_kind    = 254;
+volatile const __u8 toa_kind_v6 = 253;
+// getsockopt(IPPROTO_TCP, toa_sockopt) 返回 struct toa_addr，不与内核已有的 TCP 选项冲突即可
+volatile const __u32 toa_sockopt = 254;
+
+#define TOA_LEN    8    // kind(1) + len(1) + port(2) + addr(4)
+#define TOA_V6_LEN 20   // kind(1) + len(1) + port(2) + addr(16)
+
+#ifndef AF_INET
+#define AF_INET  2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+#ifndef SOL_TCP
+#define SOL_TCP 6
+#endif
+#ifndef TCP_SAVE_SYN
+#define TCP_SAVE_SYN 27
+#endif
+#ifndef TCP_SAVED_SYN
+#define TCP_SAVED_SYN 28
+#endif
+#ifndef ENOENT
+#define ENOENT 2
+#endif
+#define PAGE_SIZE 4096
+// 保存的 SYN 只含 IP 头和 TCP 头，IPv4 最多 60 + 60 字节，IPv6 留出扩展头的余量
+#define SAVED_SYN_MAX 256
+
+// toa_addr 是存放在 socket 上的真实客户端地址。IPv4 地址以 IPv4-mapped IPv6 形式存放，
+// family 记录选项本身的地址族
+struct toa_addr {
+    __be16 port;
+    __u16 family;
+    __u8 addr[16];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_SK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct toa_addr);
+} toa_storage SEC(".maps");
+
+// 接收端计数，顺序必须与 receiver.go 中的 receiverStatNames 一致
+enum receiver_stat {
+    RSTAT_STORED = 0,   // 找到 TOA 选项并保存
+    RSTAT_NO_TOA,       // SYN 中没有 TOA 选项
+    RSTAT_NO_STORAGE,   // 分配 socket 存储失败
+    RSTAT_PEERNAME,     // getpeername() 返回了真实客户端地址
+    RSTAT_SOCKOPT,      // getsockopt() 返回了真实客户端地址
+    RSTAT_SYNCOOKIE,    // 连接由 syncookie 建立，没有保存的 SYN 可读
+    RSTAT_SYN_KEPT,     // 内核不支持 bpf_getsockopt(TCP_SAVED_SYN) (6.0 之前)，保存的 SYN 保留到连接关闭
+    RSTAT_MAX,
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, RSTAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+} receiver_stats SEC(".maps");
+
+static __always_inline void rcount(__u32 reason)
+{
+    __u64 *c = bpf_map_lookup_elem(&receiver_stats, &reason);
+    if (c) (*c)++;
+}
+
+// load_toa 在保存的 SYN 中按 kind/len 查找 TOA 选项，找到时填写 addr 并返回 RSTAT_STORED，
+// 否则返回计数原因。没有保存的 SYN (-ENOENT) 说明连接是 syncookie 建立的
+static __always_inline enum receiver_stat load_toa(struct bpf_sock_ops *skops, struct toa_addr *addr)
+{
+    __u8 opt[TOA_V6_LEN] = { toa_kind, TOA_LEN };
+
+    long ret = bpf_load_hdr_opt(skops, opt, TOA_LEN, BPF_LOAD_HDR_OPT_TCP_SYN);
+    if (ret == -ENOENT) return RSTAT_SYNCOOKIE;
+    if (ret == TOA_LEN) {
+        addr->family = AF_INET;
+        __builtin_memcpy(&addr->port, &opt[2], sizeof(addr->port));
+        addr->addr[10] = 0xff;
+        addr->addr[11] = 0xff;
+        __builtin_memcpy(&addr->addr[12], &opt[4], 4);
+        return RSTAT_STORED;
+    }
+
+    opt[0] = toa_kind_v6;
+    opt[1] = TOA_V6_LEN;
+    if (bpf_load_hdr_opt(skops, opt, TOA_V6_LEN, BPF_LOAD_HDR_OPT_TCP_SYN) == TOA_V6_LEN) {
+        addr->family = AF_INET6;
+        __builtin_memcpy(&addr->port, &opt[2], sizeof(addr->port));
+        __builtin_memcpy(addr->addr, &opt[4], sizeof(addr->addr));
+        return RSTAT_STORED;
+    }
+    return RSTAT_NO_TOA;
+}
+
+// free_saved_syn 读完 TOA 后通过 bpf_getsockopt(TCP_SAVED_SYN) 取走保存的 SYN，内核随即释放它。
+// 应用不会自己取 TCP_SAVED_SYN，不释放时每个连接都会一直占用一份 SYN 头部的内存
+static __always_inline void free_saved_syn(struct bpf_sock_ops *skops)
+{
+    __u8 syn[SAVED_SYN_MAX];
+    if (bpf_getsockopt(skops, SOL_TCP, TCP_SAVED_SYN, syn, sizeof(syn)) < 0) rcount(RSTAT_SYN_KEPT);
+}
+
+SEC("sockops")
+int toa_receiver(struct bpf_sock_ops *skops)
+{
+    switch (skops->op) {
+    case BPF_SOCK_OPS_TCP_LISTEN_CB: {
+        // 监听 socket 打开 TCP_SAVE_SYN 后，内核为每个新连接保存 SYN 的头部，
+        // 子 socket 建立时才能用 BPF_LOAD_HDR_OPT_TCP_SYN 读取，读完后由 free_saved_syn 释放。
+        // 挂载之前已在监听的 socket 不受影响
+        int one = 1;
+        bpf_setsockopt(skops, SOL_TCP, TCP_SAVE_SYN, &one, sizeof(one));
+        break;
+    }
+
+    case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB: {
+        struct bpf_sock *sk = skops->sk;
+        struct toa_addr addr = {};
+
+        if (!sk) break;
+        enum receiver_stat reason = load_toa(skops, &addr);
+        if (reason != RSTAT_SYNCOOKIE) free_saved_syn(skops);
+        if (reason == RSTAT_STORED &&
+            !bpf_sk_storage_get(&toa_storage, sk, &addr, BPF_SK_STORAGE_GET_F_CREATE)) {
+            reason = RSTAT_NO_STORAGE;
+        }
+        rcount(reason);
+        break;
+    }
+    }
+    return 1;
+}
+
+// 应用调用 getpeername() 时，把内核填好的对端地址 (负载均衡的地址) 换成 TOA 中的真实客户端。
+// 没有 TOA 的连接保持不变。IPv4 socket 只能返回 IPv4 地址
+SEC("cgroup/getpeername4")
+int toa_getpeername4(struct bpf_sock_addr *ctx)
+{
+    struct bpf_sock *sk = ctx->sk;
+    struct toa_addr *addr;
+    __u32 ip;
+
+    if (!sk) return 1;
+    addr = bpf_sk_storage_get(&toa_storage, sk, 0, 0);
+    if (!addr || addr->family != AF_INET) return 1;
+
+    __builtin_memcpy(&ip, &addr->addr[12], sizeof(ip));
+    ctx->user_ip4 = ip;
+    ctx->user_port = addr->port;
+    rcount(RSTAT_PEERNAME);
+    return 1;
+}
+
+// IPv6 socket 直接返回存储的地址: IPv4 客户端是 IPv4-mapped 形式，与双栈 socket 的对端地址一致
+SEC("cgroup/getpeername6")
+int toa_getpeername6(struct bpf_sock_addr *ctx)
+{
+    struct bpf_sock *sk = ctx->sk;
+    struct toa_addr *addr;
+    __u32 ip6[4];
+
+    if (!sk) return 1;
+    addr = bpf_sk_storage_get(&toa_storage, sk, 0, 0);
+    if (!addr) return 1;
+
+    // 上下文字段只能按 4 字节逐个写
+    __builtin_memcpy(ip6, addr->addr, sizeof(ip6));
+    ctx->user_ip6[0] = ip6[0];
+    ctx->user_ip6[1] = ip6[1];
+    ctx->user_ip6[2] = ip6[2];
+    ctx->user_ip6[3] = ip6[3];
+    ctx->user_port = addr->port;
+    rcount(RSTAT_PEERNAME);
+    return 1;
+}
+
+// 需要同时知道负载均衡地址和真实客户端的应用用 getsockopt(IPPROTO_TCP, toa_sockopt) 取地址。
+// 内核对未知选项先返回 ENOPROTOOPT，这里再改写成功的结果；没有 TOA 的连接保留原来的错误
+SEC("cgroup/getsockopt")
+int toa_getsockopt(struct bpf_sockopt *ctx)
+{
+    void *optval = ctx->optval;
+    void *optval_end = ctx->optval_end;
+    struct bpf_sock *sk = ctx->sk;
+    struct toa_addr *addr;
+
+    if (ctx->level != SOL_TCP || ctx->optname != (int)toa_sockopt) {
+        // 其他选项保持内核的结果。optlen 超过一页时程序只能看到前一页，置 0 表示不改写
+        if (ctx->optlen > PAGE_SIZE) ctx->optlen = 0;
+        return 1;
+    }
+
+    if (!sk) return 1;
+    addr = bpf_sk_storage_get(&toa_storage, sk, 0, 0);
+    if (!addr) return 1;
+    if (optval + sizeof(*addr) > optval_end) return 1;
+
+    __builtin_memcpy(optval, addr, sizeof(*addr));
+    ctx->optlen = sizeof(*addr);
+    ctx->retval = 0;
+    rcount(RSTAT_SOCKOPT);
+    return 1;
+}
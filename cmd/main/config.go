@@ -0,0 +1,127 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+
+	"github.com/cilium/ebpf"
+)
+
+// configPin 是守护进程记录生效数据面配置的固定文件名。bpffs 上不能创建普通文件，
+// 配置以 JSON 的形式存放在一个只有一个元素的数组 map 中
+const (
+	configPin     = "datapath_config"
+	configMaxSize = 4096
+)
+
+// savedConfig 是记录下来的配置：datapathConfig 各参数的取值，以及是否启用了策略
+type savedConfig struct {
+	Flags  map[string]string `json:"flags"`
+	Policy bool              `json:"policy"`
+}
+
+// datapathFlags 返回 registerFlags 注册的参数名。-pin-dir 只决定记录存放的位置，不参与比较
+func datapathFlags() []string {
+	fs := flag.NewFlagSet("", flag.ContinueOnError)
+	var c datapathConfig
+	c.registerFlags(fs)
+	var names []string
+	fs.VisitAll(func(f *flag.Flag) {
+		if f.Name != "pin-dir" {
+			names = append(names, f.Name)
+		}
+	})
+	return names
+}
+
+// saveConfig 把 fs 中数据面参数的当前取值写入 cfg.pinDir，upgrade 据此加载与守护进程相同的配置
+func saveConfig(fs *flag.FlagSet, cfg datapathConfig) error {
+	saved := savedConfig{Flags: make(map[string]string), Policy: cfg.enablePolicy}
+	for _, name := range datapathFlags() {
+		saved.Flags[name] = fs.Lookup(name).Value.String()
+	}
+	b, err := json.Marshal(saved)
+	if err != nil {
+		return err
+	}
+	if len(b) > configMaxSize {
+		return fmt.Errorf("datapath config is %d bytes, more than %d", len(b), configMaxSize)
+	}
+
+	m, err := ebpf.NewMap(&ebpf.MapSpec{
+		Name:       configPin,
+		Type:       ebpf.Array,
+		KeySize:    4,
+		ValueSize:  configMaxSize,
+		MaxEntries: 1,
+	})
+	if err != nil {
+		return fmt.Errorf("create config map: %w", err)
+	}
+	defer m.Close()
+	value := make([]byte, configMaxSize)
+	copy(value, b)
+	if err := m.Put(uint32(0), value); err != nil {
+		return fmt.Errorf("store config: %w", err)
+	}
+	path := filepath.Join(cfg.pinDir, configPin)
+	if err := os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+		return fmt.Errorf("remove old config pin: %w", err)
+	}
+	return m.Pin(path)
+}
+
+// restoreConfig 让 upgrade 沿用守护进程记录的配置：命令行没有给出的数据面参数取记录中的值，
+// 给出了但与记录不同的参数视为错误，避免升级悄悄改变所有网卡上的数据面行为。
+// policySet 是命令行是否给出了 -policy。守护进程没有留下记录时返回 os.ErrNotExist
+func restoreConfig(fs *flag.FlagSet, cfg *datapathConfig, policySet bool) error {
+	m, err := ebpf.LoadPinnedMap(filepath.Join(cfg.pinDir, configPin), nil)
+	if err != nil {
+		return err
+	}
+	defer m.Close()
+	b, err := m.LookupBytes(uint32(0))
+	if err != nil {
+		return fmt.Errorf("read config: %w", err)
+	}
+	var saved savedConfig
+	if err := json.Unmarshal(bytes.TrimRight(b, "\x00"), &saved); err != nil {
+		return fmt.Errorf("decode config: %w", err)
+	}
+
+	given := make(map[string]bool)
+	fs.Visit(func(f *flag.Flag) { given[f.Name] = true })
+	var diffs []string
+	for _, name := range datapathFlags() {
+		want, ok := saved.Flags[name]
+		if !ok {
+			// 守护进程的版本还没有这个参数，使用命令行的值
+			continue
+		}
+		if !given[name] {
+			if err := fs.Set(name, want); err != nil {
+				return fmt.Errorf("restore -%s=%s: %w", name, want, err)
+			}
+			continue
+		}
+		if got := fs.Lookup(name).Value.String(); got != want {
+			diffs = append(diffs, fmt.Sprintf("-%s=%s (running: %s)", name, got, want))
+		}
+	}
+	if policySet && cfg.enablePolicy != saved.Policy {
+		diffs = append(diffs, fmt.Sprintf("-policy enabled=%t (running: %t)", cfg.enablePolicy, saved.Policy))
+	}
+	if len(diffs) > 0 {
+		sort.Strings(diffs)
+		return fmt.Errorf("flags differ from the running daemon, restart it to change them: %s", strings.Join(diffs, ", "))
+	}
+	cfg.enablePolicy = saved.Policy
+	return nil
+}
@@ -0,0 +1,465 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"net"
+)
+
+// 构造 PROG_TEST_RUN 用的测试帧，不依赖额外的抓包库
+
+const (
+	tcpFlagSYN = 0x02
+	tcpFlagACK = 0x10
+)
+
+// linuxSYNOptions 是 Linux 默认 SYN 携带的选项: MSS, SACK_PERM, TS, NOP, WS
+var linuxSYNOptions = []byte{
+	2, 4, 0x05, 0xb4, // MSS 1460
+	4, 2, // SACK_PERM
+	8, 10, 0, 0, 0, 1, 0, 0, 0, 0, // TS
+	1,       // NOP
+	3, 3, 7, // WS 7
+}
+
+// paddedSYNOptions 把 doff 撑满到 15，NOP/EOL 填充足够原地放下 TOA 选项
+var paddedSYNOptions = []byte{
+	2, 4, 0x05, 0xb4, // MSS 1460
+	1, 1, 4, 2, // NOP, NOP, SACK_PERM
+	1, 1, 8, 10, 0, 0, 0, 1, 0, 0, 0, 0, // NOP, NOP, TS
+	1, 3, 3, 7, // NOP, WS 7
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // EOL
+}
+
+// toaSYNOptions 是经过上一跳注入器后的 SYN 选项，末尾带有 kind 254 的 TOA 选项
+var toaSYNOptions = append(append([]byte{}, linuxSYNOptions...),
+	254, 8, 0x1f, 0x90, 172, 16, 0, 1, // TOA 172.16.0.1:8080
+)
+
+// fullSYNOptions 没有任何填充且把 doff 撑满到 15，既不能原地放下 TOA 也不能扩展
+var fullSYNOptions = []byte{
+	2, 4, 0x05, 0xb4, // MSS 1460
+	4, 2, // SACK_PERM
+	8, 10, 0, 0, 0, 1, 0, 0, 0, 0, // TS
+	3, 3, 7, // WS 7
+	30, 12, 0x01, 0x81, 1, 2, 3, 4, 5, 6, 7, 8, // MPTCP MP_CAPABLE
+	28, 4, 0x80, 0x3c, // User Timeout
+	34, 2, // TFO cookie request
+	34, 3, 0, // 凑满 40 字节
+}
+
+// routerAlertIPOption 是 IPv4 Router Alert 选项，用来构造带 IP 选项的帧
+var routerAlertIPOption = []byte{148, 4, 0, 0}
+
+// arpFrame 返回一个 ARP 请求帧，用作非 IP 报文
+func arpFrame() []byte {
+	frame := make([]byte, 14+28)
+	binary.BigEndian.PutUint16(frame[12:], 0x0806)
+	arp := frame[14:]
+	binary.BigEndian.PutUint16(arp[0:], 1)      // Ethernet
+	binary.BigEndian.PutUint16(arp[2:], 0x0800) // IPv4
+	arp[4], arp[5] = 6, 4
+	binary.BigEndian.PutUint16(arp[6:], 1) // request
+	copy(arp[14:18], net.IPv4(192, 168, 1, 10).To4())
+	copy(arp[24:28], net.IPv4(192, 168, 1, 1).To4())
+	return frame
+}
+
+// tcpSegment 描述一个 TCP 报文，src/dst 为 IPv4 地址时生成 IPv4 帧，否则生成 IPv6 帧
+type tcpSegment struct {
+	src, dst     net.IP
+	sport, dport uint16
+	flags        uint8
+	ipOptions    []byte // 仅 IPv4
+	tcpOptions   []byte
+	payload      []byte
+	vlans        []uint16 // VLAN ID，外层在前
+}
+
+// frame 生成带正确 IP/TCP 校验和的以太网帧
+func (s tcpSegment) frame() []byte {
+	if s.src.To4() == nil {
+		return withVLANs(s.ipv6Frame(), s.vlans)
+	}
+	return withVLANs(s.ipv4Frame(), s.vlans)
+}
+
+// withVLANs 在以太网头的 MAC 地址之后插入 VLAN 标签。
+// 多层标签时最外层是 802.1ad (0x88a8)，其余是 802.1Q (0x8100)
+func withVLANs(frame []byte, vids []uint16) []byte {
+	if len(vids) == 0 {
+		return frame
+	}
+	out := make([]byte, 0, len(frame)+4*len(vids))
+	out = append(out, frame[:12]...)
+	for i, vid := range vids {
+		tpid := uint16(0x8100)
+		if i == 0 && len(vids) > 1 {
+			tpid = 0x88a8
+		}
+		out = binary.BigEndian.AppendUint16(out, tpid)
+		out = binary.BigEndian.AppendUint16(out, vid)
+	}
+	return append(out, frame[12:]...)
+}
+
+// l3Offset 跳过 VLAN 标签，返回 L3 协议和 L3 头的偏移
+func l3Offset(frame []byte) (uint16, int) {
+	off := 12
+	for off+2 <= len(frame) {
+		proto := binary.BigEndian.Uint16(frame[off:])
+		if proto != 0x8100 && proto != 0x88a8 {
+			return proto, off + 2
+		}
+		off += 4
+	}
+	return 0, len(frame)
+}
+
+// tcpHeader 把 TCP 头和负载写入 b，校验和字段留 0
+func (s tcpSegment) tcpHeader(b []byte) {
+	tcpHdrLen := 20 + len(s.tcpOptions)
+	binary.BigEndian.PutUint16(b[0:], s.sport)
+	binary.BigEndian.PutUint16(b[2:], s.dport)
+	binary.BigEndian.PutUint32(b[4:], 0x12345678)
+	b[12] = uint8(tcpHdrLen/4) << 4
+	b[13] = s.flags
+	binary.BigEndian.PutUint16(b[14:], 64240)
+	copy(b[20:], s.tcpOptions)
+	copy(b[tcpHdrLen:], s.payload)
+}
+
+func (s tcpSegment) ipv6Frame() []byte {
+	tcpLen := 20 + len(s.tcpOptions) + len(s.payload)
+	frame := make([]byte, 14+40+tcpLen)
+
+	binary.BigEndian.PutUint16(frame[12:], 0x86dd)
+
+	ip := frame[14:]
+	ip[0] = 0x60
+	binary.BigEndian.PutUint16(ip[4:], uint16(tcpLen))
+	ip[6] = 6
+	ip[7] = 64
+	copy(ip[8:24], s.src.To16())
+	copy(ip[24:40], s.dst.To16())
+
+	tcp := ip[40:]
+	s.tcpHeader(tcp)
+	binary.BigEndian.PutUint16(tcp[16:], tcpChecksum(ip[8:24], ip[24:40], tcp))
+
+	return frame
+}
+
+func (s tcpSegment) ipv4Frame() []byte {
+	ipHdrLen := 20 + len(s.ipOptions)
+	tcpHdrLen := 20 + len(s.tcpOptions)
+	frame := make([]byte, 14+ipHdrLen+tcpHdrLen+len(s.payload))
+
+	binary.BigEndian.PutUint16(frame[12:], 0x0800)
+
+	ip := frame[14:]
+	ip[0] = 0x40 | uint8(ipHdrLen/4)
+	binary.BigEndian.PutUint16(ip[2:], uint16(ipHdrLen+tcpHdrLen+len(s.payload)))
+	binary.BigEndian.PutUint16(ip[6:], 0x4000) // DF
+	ip[8] = 64
+	ip[9] = 6
+	copy(ip[12:16], s.src.To4())
+	copy(ip[16:20], s.dst.To4())
+	copy(ip[20:], s.ipOptions)
+	binary.BigEndian.PutUint16(ip[10:], checksum(ip[:ipHdrLen], 0))
+
+	tcp := ip[ipHdrLen:]
+	s.tcpHeader(tcp)
+	binary.BigEndian.PutUint16(tcp[16:], tcpChecksum(ip[12:16], ip[16:20], tcp))
+
+	return frame
+}
+
+// checksum 计算 RFC 1071 校验和，initial 为已累加的部分和
+func checksum(b []byte, initial uint32) uint16 {
+	sum := initial
+	for ; len(b) >= 2; b = b[2:] {
+		sum += uint32(binary.BigEndian.Uint16(b))
+	}
+	if len(b) == 1 {
+		sum += uint32(b[0]) << 8
+	}
+	for sum > 0xffff {
+		sum = (sum >> 16) + (sum & 0xffff)
+	}
+	return ^uint16(sum)
+}
+
+// tcpChecksum 计算包含伪首部的 TCP 校验和，segment 中的校验和字段需为 0
+func tcpChecksum(src, dst net.IP, segment []byte) uint16 {
+	return l4Checksum(src, dst, 6, segment)
+}
+
+// l4Checksum 计算包含伪首部的 TCP/UDP 校验和
+func l4Checksum(src, dst net.IP, proto uint8, segment []byte) uint16 {
+	var sum uint32
+	for _, addr := range [][]byte{src, dst} {
+		for i := 0; i < len(addr); i += 2 {
+			sum += uint32(binary.BigEndian.Uint16(addr[i:]))
+		}
+	}
+	sum += uint32(proto) + uint32(len(segment))
+	return checksum(segment, sum)
+}
+
+// 隧道的默认 UDP 目的端口，与 -vxlan-port/-geneve-port 的默认值一致
+const (
+	vxlanPort  = 4789
+	genevePort = 6081
+)
+
+// encap 描述测试帧的外层封装
+type encap struct {
+	kind     string // vxlan, geneve 或 ipip
+	src, dst net.IP // 外层地址，为 IPv4 地址时生成 IPv4 外层，否则生成 IPv6 外层
+	udpCsum  bool   // 计算外层 UDP 校验和，否则填 0
+}
+
+// wrap 把以太网帧 inner 封装进外层以太网和 IP 头。VXLAN/Geneve 承载整个内层以太网帧，
+// IPIP/IP6IP6 只承载内层 IP 报文。Geneve 带一个不含数据的选项，用来覆盖选项长度字段
+func (e encap) wrap(inner []byte) []byte {
+	if e.kind == "ipip" {
+		ethType, l3 := l3Offset(inner)
+		proto := uint8(4)
+		if ethType == 0x86dd {
+			proto = 41
+		}
+		return e.outerFrame(proto, inner[l3:])
+	}
+
+	hdr := make([]byte, 8+8)
+	binary.BigEndian.PutUint16(hdr[0:], 50000)
+	binary.BigEndian.PutUint16(hdr[2:], vxlanPort)
+	hdr[8] = 0x08 // VXLAN I 标志
+	if e.kind == "geneve" {
+		binary.BigEndian.PutUint16(hdr[2:], genevePort)
+		hdr[8] = 1 // 选项长度 1 * 4 字节
+		binary.BigEndian.PutUint16(hdr[10:], 0x6558)
+		hdr = append(hdr, 0x01, 0x02, 0x80, 0)
+	}
+	hdr[14] = 100 // VNI
+	udp := append(hdr, inner...)
+	binary.BigEndian.PutUint16(udp[4:], uint16(len(udp)))
+	if e.udpCsum {
+		src, dst := e.src.To4(), e.dst.To4()
+		if src == nil {
+			src, dst = e.src.To16(), e.dst.To16()
+		}
+		csum := l4Checksum(src, dst, 17, udp)
+		if csum == 0 {
+			csum = 0xffff
+		}
+		binary.BigEndian.PutUint16(udp[6:], csum)
+	}
+	return e.outerFrame(17, udp)
+}
+
+func (e encap) outerFrame(proto uint8, payload []byte) []byte {
+	if e.src.To4() == nil {
+		frame := make([]byte, 14+40, 14+40+len(payload))
+		binary.BigEndian.PutUint16(frame[12:], 0x86dd)
+		ip := frame[14:]
+		ip[0] = 0x60
+		binary.BigEndian.PutUint16(ip[4:], uint16(len(payload)))
+		ip[6] = proto
+		ip[7] = 64
+		copy(ip[8:24], e.src.To16())
+		copy(ip[24:40], e.dst.To16())
+		return append(frame, payload...)
+	}
+
+	frame := make([]byte, 14+20, 14+20+len(payload))
+	binary.BigEndian.PutUint16(frame[12:], 0x0800)
+	ip := frame[14:]
+	ip[0] = 0x45
+	binary.BigEndian.PutUint16(ip[2:], uint16(20+len(payload)))
+	binary.BigEndian.PutUint16(ip[6:], 0x4000) // DF
+	ip[8] = 64
+	ip[9] = proto
+	copy(ip[12:16], e.src.To4())
+	copy(ip[16:20], e.dst.To4())
+	binary.BigEndian.PutUint16(ip[10:], checksum(ip[:20], 0))
+	return append(frame, payload...)
+}
+
+// decap 检查 frame 是否是 VXLAN/Geneve/IPIP 封装，是时校验外层的长度和校验和并返回内层以太网帧，
+// 否则返回 nil。IPIP 的内层没有以太网头，补一个只带类型字段的头
+func decap(frame []byte) ([]byte, error) {
+	var (
+		src, dst, l4 []byte
+		next         uint8
+	)
+	proto, l3 := l3Offset(frame)
+	switch proto {
+	case 0x0800:
+		ip := frame[l3:]
+		ihl := int(ip[0]&0x0f) * 4
+		src, dst, l4, next = ip[12:16], ip[16:20], ip[ihl:], ip[9]
+		if next != 4 && next != 41 && next != 17 {
+			return nil, nil
+		}
+		if int(binary.BigEndian.Uint16(ip[2:])) != len(ip) {
+			return nil, fmt.Errorf("outer tot_len %d, frame carries %d", binary.BigEndian.Uint16(ip[2:]), len(ip))
+		}
+		if checksum(ip[:ihl], 0) != 0 {
+			return nil, fmt.Errorf("bad outer IPv4 header checksum")
+		}
+	case 0x86dd:
+		ip := frame[l3:]
+		src, dst, l4, next = ip[8:24], ip[24:40], ip[40:], ip[6]
+		if next != 4 && next != 41 && next != 17 {
+			return nil, nil
+		}
+		if int(binary.BigEndian.Uint16(ip[4:]))+40 != len(ip) {
+			return nil, fmt.Errorf("outer payload_len %d, frame carries %d", binary.BigEndian.Uint16(ip[4:]), len(ip)-40)
+		}
+	default:
+		return nil, nil
+	}
+
+	if next != 17 {
+		inner := make([]byte, 14, 14+len(l4))
+		binary.BigEndian.PutUint16(inner[12:], 0x0800)
+		if next == 41 {
+			binary.BigEndian.PutUint16(inner[12:], 0x86dd)
+		}
+		return append(inner, l4...), nil
+	}
+
+	if len(l4) < 8+8 {
+		return nil, nil
+	}
+	port := binary.BigEndian.Uint16(l4[2:])
+	if port != vxlanPort && port != genevePort {
+		return nil, nil
+	}
+	if int(binary.BigEndian.Uint16(l4[4:])) != len(l4) {
+		return nil, fmt.Errorf("outer UDP length %d, frame carries %d", binary.BigEndian.Uint16(l4[4:]), len(l4))
+	}
+	if binary.BigEndian.Uint16(l4[6:]) != 0 && l4Checksum(src, dst, 17, l4) != 0 {
+		return nil, fmt.Errorf("bad outer UDP checksum")
+	}
+	hdr := 8 + 8
+	if port == genevePort {
+		hdr += int(l4[8]&0x3f) * 4
+	}
+	return l4[hdr:], nil
+}
+
+// verifyInjected 检查 out 是 in 注入 TOA 选项后的合法报文：L3 长度与帧长一致、
+// IPv4 头校验和与 TCP 校验和正确、doff 覆盖新选项，并且选项中的地址和端口是原报文的源地址和源端口
+// 隧道报文还要求外层长度和校验和正确，并对内层做同样的检查。
+// appended 对应 -existing-toa=ignore：程序在已有的 TOA 之后再追加一个，此时检查最后一个 TOA 选项，
+// 并要求原有的 TOA 选项保持不变
+func verifyInjected(in, out []byte, kindV4, kindV6 uint8, appended bool) error {
+	innerOut, err := decap(out)
+	if err != nil {
+		return err
+	}
+	if innerOut != nil {
+		innerIn, err := decap(in)
+		if err != nil || innerIn == nil {
+			return fmt.Errorf("input frame is not encapsulated")
+		}
+		return verifyInjected(innerIn, innerOut, kindV4, kindV6, appended)
+	}
+
+	var (
+		src, dst []byte
+		l4       []byte
+		kind     uint8
+		optLen   int
+	)
+	proto, l3 := l3Offset(out)
+	switch proto {
+	case 0x0800:
+		ip := out[l3:]
+		ihl := int(ip[0]&0x0f) * 4
+		if int(binary.BigEndian.Uint16(ip[2:])) != len(ip) {
+			return fmt.Errorf("tot_len %d, frame carries %d", binary.BigEndian.Uint16(ip[2:]), len(ip))
+		}
+		if checksum(ip[:ihl], 0) != 0 {
+			return fmt.Errorf("bad IPv4 header checksum")
+		}
+		src, dst, l4 = ip[12:16], ip[16:20], ip[ihl:]
+		kind, optLen = kindV4, 8
+	case 0x86dd:
+		ip := out[l3:]
+		if int(binary.BigEndian.Uint16(ip[4:]))+40 != len(ip) {
+			return fmt.Errorf("payload_len %d, frame carries %d", binary.BigEndian.Uint16(ip[4:]), len(ip)-40)
+		}
+		src, dst, l4 = ip[8:24], ip[24:40], ip[40:]
+		kind, optLen = kindV6, 20
+	default:
+		return fmt.Errorf("unexpected ethertype")
+	}
+
+	if tcpChecksum(src, dst, l4) != 0 {
+		return fmt.Errorf("bad TCP checksum")
+	}
+	doff := int(l4[12]>>4) * 4
+	if doff > len(l4) {
+		return fmt.Errorf("doff %d beyond segment of %d bytes", doff, len(l4))
+	}
+	if len(out) > len(in) && len(out)-len(in) != optLen {
+		return fmt.Errorf("frame grew by %d bytes, want %d", len(out)-len(in), optLen)
+	}
+
+	toas, err := findOptions(l4[20:doff], kind, optLen)
+	if err != nil {
+		return err
+	}
+	if len(toas) == 0 {
+		return fmt.Errorf("no TOA option in %x", l4[20:doff])
+	}
+	opt := toas[0]
+	if appended {
+		// 注入不改变 L2/L3 头的长度，原报文的 TCP 头与输出在同一偏移
+		inL4 := in[len(out)-len(l4):]
+		before, err := findOptions(inL4[20:int(inL4[12]>>4)*4], kind, optLen)
+		if err != nil {
+			return fmt.Errorf("input frame: %w", err)
+		}
+		if len(toas) != len(before)+1 {
+			return fmt.Errorf("%d TOA options after injection, want %d", len(toas), len(before)+1)
+		}
+		for i := range before {
+			if !bytes.Equal(toas[i], before[i]) {
+				return fmt.Errorf("existing TOA option changed from %x to %x", before[i], toas[i])
+			}
+		}
+		opt = toas[len(toas)-1]
+	}
+	if !bytes.Equal(opt[2:4], l4[0:2]) || !bytes.Equal(opt[4:], src) {
+		return fmt.Errorf("TOA option %x does not carry the source address", opt)
+	}
+	return nil
+}
+
+// findOptions 按顺序返回 TCP 选项区中种类为 kind、长度为 optLen 的选项
+func findOptions(opts []byte, kind uint8, optLen int) ([][]byte, error) {
+	var found [][]byte
+	for i := 0; i < len(opts); {
+		switch opts[i] {
+		case 0:
+			return found, nil
+		case 1:
+			i++
+			continue
+		}
+		if i+1 >= len(opts) || opts[i+1] < 2 || i+int(opts[i+1]) > len(opts) {
+			return nil, fmt.Errorf("malformed options %x", opts)
+		}
+		if opts[i] == kind && int(opts[i+1]) == optLen {
+			found = append(found, opts[i:i+optLen])
+		}
+		i += int(opts[i+1])
+	}
+	return found, nil
+}
@@ -0,0 +1,354 @@
+package main
+
+import (
+	"flag"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"path"
+	"path/filepath"
+	"regexp"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/vishvananda/netlink"
+	"golang.org/x/sys/unix"
+)
+
+// linkSelector 决定哪些网卡需要挂载 TC 程序。名称、正则、驱动三类规则任一命中即选中，
+// 再排除 exclude 命中的网卡；loopback 始终不挂载
+type linkSelector struct {
+	names   []string // 名称，支持 path.Match 通配符，例如 "ens*"
+	regex   *regexp.Regexp
+	drivers []string // 驱动名 (如 vmxnet3、virtio_net)，没有驱动的虚拟网卡按类型匹配 (如 veth、bond)
+	exclude *regexp.Regexp
+}
+
+// registerFlags 把选择规则注册为命令行参数。默认只选中 ens192 和 ens16，与之前的行为一致
+func (s *linkSelector) registerFlags(fs *flag.FlagSet) {
+	s.names = []string{"ens192", "ens16"}
+	fs.Func("iface", "comma separated interface names or glob patterns to attach to (default ens192,ens16)", func(v string) error {
+		s.names = splitList(v)
+		for _, n := range s.names {
+			if _, err := path.Match(n, ""); err != nil {
+				return fmt.Errorf("bad pattern %q: %w", n, err)
+			}
+		}
+		return nil
+	})
+	fs.Func("iface-regex", "regular expression for interface names to attach to", func(v string) (err error) {
+		s.regex, err = regexp.Compile(v)
+		return err
+	})
+	fs.Func("iface-driver", "comma separated drivers (or link kinds such as veth, bond for virtual links) to attach to", func(v string) error {
+		s.drivers = splitList(v)
+		return nil
+	})
+	fs.Func("iface-exclude", "regular expression for interface names that are never attached", func(v string) (err error) {
+		s.exclude, err = regexp.Compile(v)
+		return err
+	})
+}
+
+func splitList(v string) []string {
+	var out []string
+	for _, f := range strings.Split(v, ",") {
+		if f = strings.TrimSpace(f); f != "" {
+			out = append(out, f)
+		}
+	}
+	return out
+}
+
+func (s *linkSelector) match(l netlink.Link) bool {
+	attrs := l.Attrs()
+	if attrs.Flags&net.FlagLoopback != 0 {
+		return false
+	}
+	if s.exclude != nil && s.exclude.MatchString(attrs.Name) {
+		return false
+	}
+	for _, n := range s.names {
+		if ok, _ := path.Match(n, attrs.Name); ok {
+			return true
+		}
+	}
+	if s.regex != nil && s.regex.MatchString(attrs.Name) {
+		return true
+	}
+	if len(s.drivers) > 0 {
+		drv := linkDriver(l)
+		for _, d := range s.drivers {
+			if d == drv {
+				return true
+			}
+		}
+	}
+	return false
+}
+
+// linkDriver 从 sysfs 读取网卡驱动名，不需要 fork ethtool。
+// 没有底层设备的虚拟网卡返回链路类型
+func linkDriver(l netlink.Link) string {
+	target, err := os.Readlink(filepath.Join("/sys/class/net", l.Attrs().Name, "device/driver"))
+	if err != nil {
+		return l.Type()
+	}
+	return filepath.Base(target)
+}
+
+// linkWatcher 订阅 RTM_NEWLINK/RTM_DELLINK，在网卡出现、改名或删除时挂载或卸载程序。
+// 所有事件在同一个 goroutine 中顺序处理，挂载只是一次 bpf/netlink 系统调用
+type linkWatcher struct {
+	att *attacher
+	sel *linkSelector
+
+	mu       sync.Mutex
+	attached map[int]*watchedLink
+
+	done chan struct{}
+	wg   sync.WaitGroup
+}
+
+type watchedLink struct {
+	name string
+	att  attachment
+	// detachFailed 表示卸载失败，程序仍挂在网卡上，等待下一次对账重试
+	detachFailed bool
+}
+
+// linkUpdateBuffer 是事件通道的容量，足够吸收容器批量创建 veth 时的突发事件
+const linkUpdateBuffer = 4096
+
+// detachRetryInterval 是卸载失败后重新对账的间隔
+const detachRetryInterval = 30 * time.Second
+
+func newLinkWatcher(att *attacher, sel *linkSelector) *linkWatcher {
+	return &linkWatcher{
+		att:      att,
+		sel:      sel,
+		attached: make(map[int]*watchedLink),
+		done:     make(chan struct{}),
+	}
+}
+
+// start 先订阅再全量对账，订阅建立之前已存在的网卡和期间发生的变化都不会遗漏
+func (w *linkWatcher) start() error {
+	updates, errs, err := w.subscribe()
+	if err != nil {
+		return err
+	}
+	if err := w.reconcile(); err != nil {
+		return err
+	}
+	// 上一个进程挂载、现在不再需要的网卡
+	keep := make(map[int]bool)
+	for _, t := range w.targets() {
+		keep[t.slot] = true
+	}
+	w.att.removeStalePins(keep)
+
+	w.wg.Add(1)
+	go w.run(updates, errs)
+	return nil
+}
+
+func (w *linkWatcher) subscribe() (chan netlink.LinkUpdate, chan error, error) {
+	updates := make(chan netlink.LinkUpdate, linkUpdateBuffer)
+	errs := make(chan error, 1)
+	err := netlink.LinkSubscribeWithOptions(updates, w.done, netlink.LinkSubscribeOptions{
+		ErrorCallback: func(err error) {
+			select {
+			case errs <- err:
+			default:
+			}
+		},
+	})
+	if err != nil {
+		return nil, nil, fmt.Errorf("subscribe to link updates: %w", err)
+	}
+	return updates, errs, nil
+}
+
+func (w *linkWatcher) run(updates chan netlink.LinkUpdate, errs chan error) {
+	defer w.wg.Done()
+	retry := time.NewTicker(detachRetryInterval)
+	defer retry.Stop()
+	for {
+		select {
+		case <-w.done:
+			return
+		case <-retry.C:
+			if w.detachPending() {
+				if err := w.reconcile(); err != nil {
+					log.Printf("Failed to resynchronize interfaces: %v", err)
+				}
+			}
+		case u, ok := <-updates:
+			if !ok {
+				// 订阅出错 (例如 socket 接收缓冲区溢出丢了事件) 后通道会被关闭，
+				// 重新订阅并全量对账
+				updates, errs = w.resubscribe()
+				continue
+			}
+			w.handle(u)
+		case err := <-errs:
+			log.Printf("Link subscription error: %v", err)
+		}
+	}
+}
+
+func (w *linkWatcher) resubscribe() (chan netlink.LinkUpdate, chan error) {
+	for {
+		select {
+		case <-w.done:
+			return nil, nil
+		default:
+		}
+		updates, errs, err := w.subscribe()
+		if err == nil {
+			if err = w.reconcile(); err == nil {
+				return updates, errs
+			}
+		}
+		log.Printf("Failed to resynchronize interfaces, retrying: %v", err)
+		time.Sleep(time.Second)
+	}
+}
+
+func (w *linkWatcher) handle(u netlink.LinkUpdate) {
+	switch u.Header.Type {
+	case unix.RTM_NEWLINK:
+		w.update(u.Link)
+	case unix.RTM_DELLINK:
+		w.remove(u.Link.Attrs().Index, true)
+	}
+}
+
+// update 处理一个新出现或属性变化的网卡
+func (w *linkWatcher) update(l netlink.Link) {
+	attrs := l.Attrs()
+	want := w.sel.match(l)
+
+	w.mu.Lock()
+	cur, ok := w.attached[attrs.Index]
+	if ok {
+		cur.name = attrs.Name
+		// 卸载失败后网卡又符合了规则，程序本来就还挂着，不再重试卸载
+		if want {
+			cur.detachFailed = false
+		}
+	}
+	w.mu.Unlock()
+
+	switch {
+	case want && !ok:
+		start := time.Now()
+		a, err := w.att.attach(attrs.Index)
+		if err != nil {
+			log.Printf("Failed to attach BPF program to %s: %v", attrs.Name, err)
+			return
+		}
+		log.Printf("Successfully attached BPF program to interface %q (%s) in %s", attrs.Name, a.Mode(), time.Since(start))
+		w.mu.Lock()
+		w.attached[attrs.Index] = &watchedLink{name: attrs.Name, att: a}
+		w.mu.Unlock()
+	case !want && ok:
+		// 改名后不再符合规则
+		w.remove(attrs.Index, false)
+	}
+}
+
+// remove 卸载 ifindex 上的程序。gone 表示网卡已被删除，内核会一并清理挂载，
+// 这里只释放用户态持有的句柄。卸载失败时保留记录，程序仍计入计数和指标，下一次对账时重试
+func (w *linkWatcher) remove(ifindex int, gone bool) {
+	w.mu.Lock()
+	cur, ok := w.attached[ifindex]
+	w.mu.Unlock()
+	if !ok {
+		return
+	}
+	if err := cur.att.Detach(); err != nil && !gone {
+		log.Printf("Failed to detach from %s, will retry: %v", cur.name, err)
+		w.mu.Lock()
+		cur.detachFailed = true
+		w.mu.Unlock()
+		return
+	}
+	w.mu.Lock()
+	delete(w.attached, ifindex)
+	w.mu.Unlock()
+	log.Printf("Detached from interface %q", cur.name)
+}
+
+// detachPending 判断是否有卸载失败、等待重试的网卡
+func (w *linkWatcher) detachPending() bool {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	for _, l := range w.attached {
+		if l.detachFailed {
+			return true
+		}
+	}
+	return false
+}
+
+// reconcile 按当前网卡列表全量对账：挂载符合规则的新网卡，丢弃已消失网卡的挂载
+func (w *linkWatcher) reconcile() error {
+	links, err := netlink.LinkList()
+	if err != nil {
+		return fmt.Errorf("list links: %w", err)
+	}
+	present := make(map[int]bool, len(links))
+	for _, l := range links {
+		present[l.Attrs().Index] = true
+		w.update(l)
+	}
+
+	w.mu.Lock()
+	var stale []int
+	for ifindex := range w.attached {
+		if !present[ifindex] {
+			stale = append(stale, ifindex)
+		}
+	}
+	w.mu.Unlock()
+	for _, ifindex := range stale {
+		w.remove(ifindex, true)
+	}
+	return nil
+}
+
+// targets 返回当前已挂载网卡的快照，供计数输出和指标使用
+func (w *linkWatcher) targets() map[string]target {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	m := make(map[string]target, len(w.attached))
+	for ifindex, l := range w.attached {
+		m[l.name] = target{slot: ifindex, mode: l.att.Mode()}
+	}
+	return m
+}
+
+// stop 停止订阅并卸载所有网卡上的程序。keep 为 true 时只释放句柄，
+// 固定的 link 和 clsact filter 留在网卡上等待下一个进程接管
+func (w *linkWatcher) stop(keep bool) {
+	close(w.done)
+	w.wg.Wait()
+
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	for ifindex, l := range w.attached {
+		delete(w.attached, ifindex)
+		if keep {
+			l.att.Release()
+			continue
+		}
+		log.Printf("Detaching from interface %s", l.name)
+		if err := l.att.Detach(); err != nil {
+			log.Printf("Failed to detach from %s: %v", l.name, err)
+		}
+	}
+}
@@ -0,0 +1,398 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"log"
+	"os"
+	"path/filepath"
+
+	"github.com/cilium/ebpf"
+	"github.com/cilium/ebpf/btf"
+)
+
+// engine 选择写入 TOA 选项的方式
+type engine string
+
+const (
+	// engineTC 在网卡 egress 上用 TC 程序改写 SYN 报文
+	engineTC engine = "tc"
+	// engineSockops 在 cgroup 上用 sockops 程序让内核构造 SYN 时直接写入选项 (内核 5.10+)，
+	// 只覆盖本机发起的连接
+	engineSockops engine = "sockops"
+	// engineXDP 在转发节点网卡的 XDP 入口注入经过的 SYN 并直接重定向到出口网卡 (内核 5.9+)
+	engineXDP engine = "xdp"
+	// engineTCIngress 在转发网关网卡的 TC ingress 上注入，并用 bpf_redirect_neigh 绕过协议栈转发 (内核 5.11+)
+	engineTCIngress engine = "tc-ingress"
+	// engineLWT 把程序挂在去往后端网段的路由上 (LWT xmit)，只有这些路由上的报文进入程序 (内核 4.10+)
+	engineLWT engine = "lwt"
+)
+
+func parseEngine(s string) (engine, error) {
+	switch e := engine(s); e {
+	case engineTC, engineSockops, engineXDP, engineTCIngress, engineLWT:
+		return e, nil
+	}
+	return "", fmt.Errorf("unknown engine %q (want tc, sockops, xdp, tc-ingress or lwt)", s)
+}
+
+// String 和 Set 让 engine 可以直接作为命令行参数，upgrade 记录和比较参数时能读回取值
+func (e *engine) String() string { return string(*e) }
+
+func (e *engine) Set(s string) error {
+	v, err := parseEngine(s)
+	if err != nil {
+		return err
+	}
+	*e = v
+	return nil
+}
+
+// datapathConfig 是加载程序前写入 .rodata 的只读配置
+type datapathConfig struct {
+	engine engine
+	kindV4 uint
+	kindV6 uint
+	// existingTOA 决定 SYN 已带有 TOA 选项时跳过还是原地改写
+	existingTOA string
+	// enablePolicy 打开目的地址策略，policyMaxEntries 是策略前缀树的容量
+	enablePolicy     bool
+	policyMaxEntries uint
+	// statsSlots 是按 ifindex 计数的槽位数，ifindex 不小于它的网卡共用 0 号槽位
+	statsSlots uint
+	// pinDir 是 bpffs 上的固定目录，为空时不固定任何对象
+	pinDir string
+	// strictPins 要求复用已固定的 map，不兼容时报错而不是重建 (upgrade 使用)
+	strictPins bool
+	// proxyAddr 注入代理通过 setsockopt(IPPROTO_TCP, proxySockopt) 设置的客户端地址 (内核 5.10+)，
+	// proxyMaxConns 是 TC 引擎下同时握手的连接数上限
+	proxyAddr     bool
+	proxySockopt  uint
+	proxyMaxConns uint
+	// conntrack 通过 conntrack 查出 SNAT 之前的源地址，内核不支持时自动关闭
+	conntrack bool
+	// xdpRedirect 让 XDP 引擎按路由直接重定向，关闭时注入后交给协议栈转发
+	xdpRedirect bool
+	// ingressRedirect 让 TC ingress 引擎绕过协议栈转发，关闭时只在入口注入
+	ingressRedirect bool
+	// tunnels 让 TC 引擎注入 VXLAN/Geneve/IPIP 报文的内层 SYN，vxlanPort/genevePort 是识别隧道的 UDP 目的端口
+	tunnels    bool
+	vxlanPort  uint
+	genevePort uint
+	// 功能开关，关闭的功能在加载时被 verifier 当作死代码剪掉
+	enableIPv6    bool
+	enableStats   bool
+	enableCompact bool
+	// recomputeCsum 只供 bench 使用：按旧写法用 BPF_F_RECOMPUTE_CSUM 扩展报文，作为增量更新校验和的对照
+	recomputeCsum bool
+}
+
+// existing_toa_mode 的取值，与 C 中的 EXISTING_TOA_* 一致
+const (
+	existingTOASkip      uint8 = 0
+	existingTOAOverwrite uint8 = 1
+	existingTOAIgnore    uint8 = 2
+)
+
+// registerFlags 把配置项注册为命令行参数
+func (c *datapathConfig) registerFlags(fs *flag.FlagSet) {
+	c.engine = engineTC
+	fs.Var(&c.engine, "engine", "how the option is written: tc (rewrite SYNs on interface egress), sockops (let the kernel write it, local connections only), xdp (rewrite forwarded SYNs in XDP) tc-ingress (rewrite on interface ingress and forward TCP flows past the routing stack) or lwt (rewrite SYNs on the routes given by -routes only)")
+	fs.UintVar(&c.kindV4, "toa-kind", 254, "TCP option kind used for the IPv4 TOA option")
+	fs.UintVar(&c.kindV6, "toa-kind-v6", 253, "TCP option kind used for the IPv6 TOA option")
+	fs.StringVar(&c.existingTOA, "existing-toa", "skip", "what to do with SYNs that already carry a TOA option: skip, overwrite or ignore (append another one without checking)")
+	fs.UintVar(&c.policyMaxEntries, "policy-max-entries", 65536, "capacity of the destination policy LPM trie")
+	fs.UintVar(&c.statsSlots, "stats-slots", 1024, "number of per-ifindex counter slots; larger ifindexes share slot 0")
+	fs.StringVar(&c.pinDir, "pin-dir", "/sys/fs/bpf/ebpf-injector", "bpffs directory for pinned maps, program and links, so restarts keep the datapath and counters; empty disables pinning")
+	fs.BoolVar(&c.proxyAddr, "proxy-addr", false, "inject the client address a local proxy sets on its upstream socket with setsockopt(IPPROTO_TCP, -proxy-sockopt) instead of the SYN's source address")
+	fs.UintVar(&c.proxySockopt, "proxy-sockopt", 254, "TCP-level socket option number proxies use to set the client address")
+	fs.UintVar(&c.proxyMaxConns, "proxy-max-conns", 65536, "capacity of the table of handshaking proxied connections (tc engine)")
+	fs.BoolVar(&c.conntrack, "conntrack", false, "look SYNs up in conntrack and inject the pre-SNAT source address and port (tc engine, kernel 6.0+ with nf_conntrack); falls back to the packet source when unsupported")
+	fs.BoolVar(&c.xdpRedirect, "xdp-redirect", true, "xdp engine: forward injected SYNs straight to the egress interface found by a FIB lookup; SYNs it cannot redirect are counted as not_forwarded or fwd_* and handed to the kernel stack; false hands them all to the kernel stack")
+	fs.BoolVar(&c.ingressRedirect, "ingress-redirect", true, "tc-ingress engine: forward TCP packets with bpf_fib_lookup and bpf_redirect_neigh, skipping netfilter and the routing stack; false only injects")
+	fs.BoolVar(&c.tunnels, "tunnels", false, "tc engines: inject into the inner SYN of VXLAN, Geneve and IPIP/IP6IP6 packets and fix the outer lengths and checksums, so one attachment on the underlay interface covers every pod")
+	fs.UintVar(&c.vxlanPort, "vxlan-port", 4789, "UDP destination port that marks VXLAN packets for -tunnels")
+	fs.UintVar(&c.genevePort, "geneve-port", 6081, "UDP destination port that marks Geneve packets for -tunnels")
+	fs.BoolVar(&c.enableIPv6, "ipv6", true, "inject into IPv6 SYNs")
+	fs.BoolVar(&c.enableStats, "stats", true, "maintain per-interface datapath counters")
+	fs.BoolVar(&c.enableCompact, "compact", true, "reuse NOP/EOL padding before growing the packet")
+}
+
+func (c *datapathConfig) constants() (map[string]interface{}, error) {
+	for _, k := range []uint{c.kindV4, c.kindV6} {
+		// 0 (EOL) 和 1 (NOP) 是单字节选项，不能作为 TOA 的 kind
+		if k < 2 || k > 255 {
+			return nil, fmt.Errorf("invalid TCP option kind %d", k)
+		}
+	}
+	var existingMode uint8
+	switch c.existingTOA {
+	case "skip":
+		existingMode = existingTOASkip
+	case "overwrite":
+		existingMode = existingTOAOverwrite
+	case "ignore":
+		existingMode = existingTOAIgnore
+	default:
+		return nil, fmt.Errorf("invalid -existing-toa %q (want skip, overwrite or ignore)", c.existingTOA)
+	}
+	if c.statsSlots == 0 {
+		return nil, fmt.Errorf("-stats-slots must be positive")
+	}
+	if c.policyMaxEntries == 0 {
+		return nil, fmt.Errorf("-policy-max-entries must be positive")
+	}
+	if c.proxyMaxConns == 0 {
+		return nil, fmt.Errorf("-proxy-max-conns must be positive")
+	}
+	for _, p := range []uint{c.vxlanPort, c.genevePort} {
+		if p == 0 || p > 65535 {
+			return nil, fmt.Errorf("invalid tunnel UDP port %d", p)
+		}
+	}
+	if c.vxlanPort == c.genevePort {
+		return nil, fmt.Errorf("-vxlan-port and -geneve-port must differ")
+	}
+	// LWT 程序没有 socket cookie 和 conntrack kfunc 可用
+	if c.engine == engineLWT && (c.proxyAddr || c.conntrack) {
+		return nil, fmt.Errorf("-proxy-addr and -conntrack are not supported by the lwt engine")
+	}
+	return map[string]interface{}{
+		"toa_kind":          uint8(c.kindV4),
+		"toa_kind_v6":       uint8(c.kindV6),
+		"stats_slots":       uint32(c.statsSlots),
+		"existing_toa_mode": existingMode,
+		"policy_enabled":    c.enablePolicy,
+		"enable_ipv6":       c.enableIPv6,
+		"enable_stats":      c.enableStats,
+		"enable_compact":    c.enableCompact,
+		"proxy_addr":        c.proxyAddr,
+		"toa_sockopt":       uint32(c.proxySockopt),
+		"ct_lookup":         c.conntrack,
+		"xdp_redirect":      c.xdpRedirect,
+		"ingress_redirect":  c.ingressRedirect,
+		"enable_tunnels":    c.tunnels,
+		"vxlan_port":        uint16(c.vxlanPort),
+		"geneve_port":       uint16(c.genevePort),
+		"recompute_csum":    c.recomputeCsum,
+	}, nil
+}
+
+// pinnedMaps 是需要跨进程重启保留的 map：计数、策略、代理已经设置的客户端地址，
+// 以及 XDP 引擎的重定向出口 (升级后替换进去的程序继续使用同一张表)
+var pinnedMaps = []string{"stats", "policy", "proxy_clients", "proxy_cookies", "tx_ports"}
+
+// pinDir 下程序和 cgroup link 的固定文件名
+const (
+	tcProgramPin      = "inject_tcp_option"
+	sockopsProgramPin = "inject_toa_sockops"
+	xdpProgramPin     = "inject_toa_xdp"
+	ingressProgramPin = "inject_toa_ingress"
+	lwtProgramPin     = "inject_toa_lwt"
+	cgroupLinkPin     = "cgroup_sockops"
+	// 代理地址的 cgroup 钩子
+	setsockoptLinkPin   = "cgroup_setsockopt"
+	proxySockopsLinkPin = "cgroup_proxy_sockops"
+)
+
+// loadDatapath 加载 bpf2go 内嵌的对象，并在加载前改写配置常量。
+// 同一个对象按配置特化成不同的程序，不需要为每种功能组合单独编译。
+// 设置了 pinDir 时，计数和策略 map 按名字固定在 pinDir 下，重启后直接复用已有的 map。
+// 程序由调用方通过 pinProgram 固定：守护进程在加载后、挂载前固定，attacher 为网卡挂载的是固定的当前版本；
+// upgrade 在所有挂载点替换成功后才固定新程序
+func loadDatapath(cfg datapathConfig, objs *bpfObjects) error {
+	spec, err := loadBpf()
+	if err != nil {
+		return err
+	}
+	if cfg.conntrack && !haveKfunc("bpf_skb_ct_lookup", "nf_conntrack") {
+		log.Printf("Kernel has no bpf_skb_ct_lookup, injecting the post-NAT source address")
+		cfg.conntrack = false
+	}
+	consts, err := cfg.constants()
+	if err != nil {
+		return err
+	}
+	if err := spec.RewriteConstants(consts); err != nil {
+		return fmt.Errorf("rewrite constants: %w", err)
+	}
+	// enum stat_reason 增删原因后 Go 侧的常量必须同步，否则计数会错位
+	if got, want := spec.Maps["stats"].ValueSize, uint32(binary.Size(datapathStats{})); got != want {
+		return fmt.Errorf("stats map value is %d bytes but Go expects %d: stat reasons out of sync with the BPF object", got, want)
+	}
+	spec.Maps["stats"].MaxEntries = uint32(cfg.statsSlots)
+	spec.Maps["policy"].MaxEntries = uint32(cfg.policyMaxEntries)
+	// 未启用的 map 不会被程序访问，只保留最小容量
+	if !cfg.enableStats {
+		spec.Maps["stats"].MaxEntries = 1
+	}
+	if !cfg.enablePolicy {
+		spec.Maps["policy"].MaxEntries = 1
+	}
+	spec.Maps["proxy_cookies"].MaxEntries = uint32(cfg.proxyMaxConns)
+	if !cfg.proxyAddr {
+		spec.Maps["proxy_cookies"].MaxEntries = 1
+		// socket 存储换成最小的数组占位，不要求内核支持 SK_STORAGE
+		clients := spec.Maps["proxy_clients"]
+		clients.Type, clients.Flags, clients.MaxEntries = ebpf.Array, 0, 1
+	}
+
+	var opts ebpf.CollectionOptions
+	if cfg.pinDir != "" {
+		if err := os.MkdirAll(cfg.pinDir, 0o755); err != nil {
+			return fmt.Errorf("create pin dir: %w", err)
+		}
+		for _, name := range pinnedMaps {
+			spec.Maps[name].Pinning = ebpf.PinByName
+		}
+		opts.Maps.PinPath = cfg.pinDir
+	}
+
+	err = assignDatapath(spec, cfg.engine, objs, &opts)
+	if errors.Is(err, ebpf.ErrMapIncompatible) && !cfg.strictPins {
+		// 配置改变了 map 的大小，旧的固定 map 无法复用，只能丢弃重建
+		log.Printf("Pinned maps in %s do not match the configuration, recreating them (counters are reset)", cfg.pinDir)
+		for _, name := range pinnedMaps {
+			os.Remove(filepath.Join(cfg.pinDir, name))
+		}
+		err = assignDatapath(spec, cfg.engine, objs, &opts)
+	}
+	if err != nil || !cfg.proxyAddr {
+		return err
+	}
+	return assignProxy(spec, cfg.engine, objs)
+}
+
+// assignDatapath 只加载所选引擎的程序：另一个程序不会经过 verifier，
+// 老内核缺少 sockops 选项相关的 helper 也不影响 TC 引擎
+func assignDatapath(spec *ebpf.CollectionSpec, e engine, objs *bpfObjects, opts *ebpf.CollectionOptions) error {
+	switch e {
+	case engineSockops:
+		var sel struct {
+			bpfMaps
+			InjectToaSockops *ebpf.Program `ebpf:"inject_toa_sockops"`
+		}
+		if err := spec.LoadAndAssign(&sel, opts); err != nil {
+			return err
+		}
+		objs.bpfMaps, objs.InjectToaSockops = sel.bpfMaps, sel.InjectToaSockops
+	case engineXDP:
+		var sel struct {
+			bpfMaps
+			InjectToaXdp *ebpf.Program `ebpf:"inject_toa_xdp"`
+		}
+		if err := spec.LoadAndAssign(&sel, opts); err != nil {
+			return err
+		}
+		objs.bpfMaps, objs.InjectToaXdp = sel.bpfMaps, sel.InjectToaXdp
+	case engineTCIngress:
+		var sel struct {
+			bpfMaps
+			InjectToaIngress *ebpf.Program `ebpf:"inject_toa_ingress"`
+		}
+		if err := spec.LoadAndAssign(&sel, opts); err != nil {
+			return err
+		}
+		objs.bpfMaps, objs.InjectToaIngress = sel.bpfMaps, sel.InjectToaIngress
+	case engineLWT:
+		var sel struct {
+			bpfMaps
+			InjectToaLwt *ebpf.Program `ebpf:"inject_toa_lwt"`
+		}
+		if err := spec.LoadAndAssign(&sel, opts); err != nil {
+			return err
+		}
+		objs.bpfMaps, objs.InjectToaLwt = sel.bpfMaps, sel.InjectToaLwt
+	default:
+		var sel struct {
+			bpfMaps
+			InjectTcpOption *ebpf.Program `ebpf:"inject_tcp_option"`
+		}
+		if err := spec.LoadAndAssign(&sel, opts); err != nil {
+			return err
+		}
+		objs.bpfMaps, objs.InjectTcpOption = sel.bpfMaps, sel.InjectTcpOption
+	}
+	return nil
+}
+
+// haveKfunc 在内核 BTF 和 module 的 BTF 中查找 kfunc。
+// nf_conntrack 编译成模块时，它的 kfunc 只出现在 /sys/kernel/btf/nf_conntrack 中
+func haveKfunc(name, module string) bool {
+	base, err := btf.LoadKernelSpec()
+	if err != nil {
+		return false
+	}
+	if _, err := base.AnyTypeByName(name); err == nil {
+		return true
+	}
+	f, err := os.Open(filepath.Join("/sys/kernel/btf", module))
+	if err != nil {
+		return false
+	}
+	defer f.Close()
+	spec, err := btf.LoadSplitSpecFromReader(f, base)
+	if err != nil {
+		return false
+	}
+	_, err = spec.AnyTypeByName(name)
+	return err == nil
+}
+
+// assignProxy 加载代理地址的 cgroup 钩子，复用 assignDatapath 创建的 map。
+// sockops 引擎直接读取 socket 存储，不需要按 cookie 复制的程序
+func assignProxy(spec *ebpf.CollectionSpec, e engine, objs *bpfObjects) error {
+	opts := &ebpf.CollectionOptions{MapReplacements: map[string]*ebpf.Map{
+		"proxy_clients": objs.ProxyClients,
+		"proxy_cookies": objs.ProxyCookies,
+	}}
+	var sel struct {
+		SetClientAddr *ebpf.Program `ebpf:"set_client_addr"`
+	}
+	if err := spec.LoadAndAssign(&sel, opts); err != nil {
+		return err
+	}
+	objs.SetClientAddr = sel.SetClientAddr
+	if e == engineSockops {
+		return nil
+	}
+	var cp struct {
+		ProxyAddrSockops *ebpf.Program `ebpf:"proxy_addr_sockops"`
+	}
+	if err := spec.LoadAndAssign(&cp, opts); err != nil {
+		return err
+	}
+	objs.ProxyAddrSockops = cp.ProxyAddrSockops
+	return nil
+}
+
+// programPin 返回引擎使用的程序及其固定文件名
+func programPin(e engine, objs *bpfObjects) (string, *ebpf.Program) {
+	switch e {
+	case engineSockops:
+		return sockopsProgramPin, objs.InjectToaSockops
+	case engineXDP:
+		return xdpProgramPin, objs.InjectToaXdp
+	case engineTCIngress:
+		return ingressProgramPin, objs.InjectToaIngress
+	case engineLWT:
+		return lwtProgramPin, objs.InjectToaLwt
+	}
+	return tcProgramPin, objs.InjectTcpOption
+}
+
+// pinProgram 把程序固定到 pinDir，替换上一个进程固定的版本。
+// 固定的程序是当前生效的版本，新出现的网卡也挂载它，用 bpftool 也可以查看
+func pinProgram(objs *bpfObjects, cfg datapathConfig) error {
+	name, prog := programPin(cfg.engine, objs)
+	path := filepath.Join(cfg.pinDir, name)
+	if err := os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+		return fmt.Errorf("remove old program pin: %w", err)
+	}
+	if err := prog.Pin(path); err != nil {
+		return fmt.Errorf("pin program: %w", err)
+	}
+	return nil
+}
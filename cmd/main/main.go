@@ -1,104 +1,260 @@
 package main
 
 import (
-	_ "github.com/cilium/ebpf/link"
+	"flag"
+	"fmt"
 	"log"
-	"net"
 	"os"
-	"os/exec"
-	"syscall"
-
 	"os/signal"
-	_ "path/filepath"
-	"strings"
+	"path/filepath"
+	"syscall"
+	"time"
 
+	"github.com/cilium/ebpf"
 	"github.com/cilium/ebpf/rlimit"
 )
+
 //go:generate go run github.com/cilium/ebpf/cmd/bpf2go  -cc clang bpf bpf_tcp_option_kern.c -- -O2 -g -Wall -Werror -I/usr/include/x86_64-linux-gnu -I/usr/include
+//go:generate go run github.com/cilium/ebpf/cmd/bpf2go  -cc clang receiver bpf_toa_receiver_kern.c -- -O2 -g -Wall -Werror -I/usr/include/x86_64-linux-gnu -I/usr/include
 func main() {
+	// ebpf-injector bench ... 运行性能测试，不启动守护进程
+	if len(os.Args) > 1 && os.Args[1] == "bench" {
+		runBench(os.Args[2:])
+		return
+	}
+	// ebpf-injector receiver ... 在后端服务器上从 SYN 中取出 TOA 地址
+	if len(os.Args) > 1 && os.Args[1] == "receiver" {
+		runReceiver(os.Args[2:])
+		return
+	}
+	// ebpf-injector upgrade ... 把本二进制的程序原子替换进正在运行的数据面
+	if len(os.Args) > 1 && os.Args[1] == "upgrade" {
+		runUpgrade(os.Args[2:])
+		return
+	}
+
+	attachModeFlag := flag.String("attach-mode", string(attachModeAuto), "how to attach to interfaces: auto, tcx or tc")
+	statsInterval := flag.Duration("stats-interval", time.Minute, "interval for logging per-interface datapath counters, 0 to disable")
+	cgroupPath := flag.String("cgroup", "/sys/fs/cgroup", "cgroup v2 directory the sockops engine and the -proxy-addr hooks are attached to")
+	metricsAddr := flag.String("metrics-addr", "", "serve Prometheus metrics on this TCP address (e.g. 127.0.0.1:9435) or unix:<path>; empty disables")
+	runtimeStats := flag.Bool("runtime-stats", false, "enable BPF_ENABLE_STATS and report the program's kernel run time in logs and metrics; costs two clock reads per packet")
+	keepOnExit := flag.Bool("keep-on-exit", true, "leave the pinned program attached on exit so the next instance takes over without a gap; false detaches and removes the pins")
+	routes := flag.String("routes", "", "lwt engine: comma separated backend prefixes whose routes get the program; existing routes keep their next hop, missing ones are created via the current next hop")
+	routeTable := flag.Int("route-table", 254, "lwt engine: routing table of the -routes routes")
+	policyFile := flag.String("policy", "", "file with destination prefixes (and optional port ranges) that get the TOA option; reloaded on SIGHUP")
+	var cfg datapathConfig
+	cfg.registerFlags(flag.CommandLine)
+	var sel linkSelector
+	sel.registerFlags(flag.CommandLine)
+	flag.Parse()
+	cfg.enablePolicy = *policyFile != ""
+
+	mode, err := parseAttachMode(*attachModeFlag)
+	if err != nil {
+		log.Fatalf("Invalid -attach-mode: %v", err)
+	}
+
 	log.Println("Starting eBPF injector...")
 
 	// 监听 Ctrl+C 等中断信号
 	stopper := make(chan os.Signal, 1)
 	signal.Notify(stopper, os.Interrupt, syscall.SIGTERM)
+	// SIGHUP 重新加载策略文件
+	reload := make(chan os.Signal, 1)
+	signal.Notify(reload, syscall.SIGHUP)
 
 	// eBPF 程序通常需要提升内存锁定限制
 	if err := rlimit.RemoveMemlock(); err != nil {
 		log.Fatalf("Failed to remove memlock limit: %v", err)
 	}
 
-	// 检查 bpf2go 生成的 .o 文件是否存在
-	// 这是 tc 命令将要使用的文件
-	objFileName := "bpf_bpfel.o"
-	if _, err := os.Stat(objFileName); os.IsNotExist(err) {
-		log.Fatalf("eBPF object file %s not found. Please run 'go generate' first.", objFileName)
+	// 通过 bpf2go 生成的加载器（内嵌 .o）只加载一次程序，
+	// 内核只需解析、校验、JIT 一次，所有网卡共享同一个程序实例
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		log.Fatalf("Failed to load eBPF objects: %v", err)
+	}
+	defer objs.Close()
+	if cfg.pinDir != "" {
+		if err := pinProgram(&objs, cfg); err != nil {
+			log.Fatalf("Failed to pin program: %v", err)
+		}
+		// upgrade 按这份记录加载新程序，不会因为参数不同悄悄改变数据面的行为
+		if err := saveConfig(flag.CommandLine, cfg); err != nil {
+			log.Fatalf("Failed to record the datapath config: %v", err)
+		}
 	}
 
-	// 获取所有网络接口
-	ifaces, err := net.Interfaces()
-	if err != nil {
-		log.Fatalf("Failed to get network interfaces: %v", err)
+	// 在挂载之前写入策略，避免挂载后短暂地对所有 SYN 注入或全部跳过
+	if cfg.enablePolicy {
+		if err := applyPolicy(objs.Policy, *policyFile); err != nil {
+			log.Fatalf("Failed to apply policy: %v", err)
+		}
 	}
 
-	var attachedInterfaces []string
+	// 代理地址的钩子先于数据面挂载，代理设置过地址的连接从第一个 SYN 起就注入这个地址
+	proxyHooks, err := attachProxyHooks(&objs, cfg, *cgroupPath)
+	if err != nil {
+		log.Fatalf("Failed to attach proxy address hooks: %v", err)
+	}
+	if cfg.proxyAddr {
+		log.Printf("Proxies in cgroup %s can set the client address with socket option %d", *cgroupPath, cfg.proxySockopt)
+	}
 
-	// 遍历所有网络接口
-	for _, iface := range ifaces {
-		if iface.Name != "ens192" && iface.Name != "ens16" {
-			continue
+	// targets 返回当前挂载点名称到计数槽位的映射，detach 在退出时卸载或保留所有程序
+	var (
+		targets func() map[string]target
+		detach  func(keep bool)
+	)
+	switch cfg.engine {
+	case engineSockops:
+		a, err := attachCgroup(objs.InjectToaSockops, *cgroupPath, cfg.pinDir)
+		if err != nil {
+			log.Fatalf("Failed to attach sockops program: %v", err)
+		}
+		log.Printf("Successfully attached sockops program to cgroup %s", *cgroupPath)
+		// sockops 程序的计数都记在 0 号槽位
+		targets = func() map[string]target { return map[string]target{*cgroupPath: {slot: 0, mode: a.Mode()}} }
+		detach = func(keep bool) {
+			if keep {
+				a.Release()
+				return
+			}
+			log.Printf("Detaching from cgroup %s", *cgroupPath)
+			if err := a.Detach(); err != nil {
+				log.Printf("Failed to detach from %s: %v", *cgroupPath, err)
+			}
 		}
-		// 忽略 loopback、down状态的接口，以及常见的虚拟网卡（如 veth, docker0）
-		if iface.Flags&net.FlagUp == 0 || iface.Flags&net.FlagLoopback != 0 || strings.HasPrefix(iface.Name, "veth") || strings.HasPrefix(iface.Name, "docker") {
-			continue
+	case engineLWT:
+		prefixes, err := parseRoutePrefixes(*routes)
+		if err != nil {
+			log.Fatalf("Invalid -routes: %v", err)
 		}
-
-		log.Printf("Attempting to attach to interface %s...", iface.Name)
-
-		// 1. 添加 clsact qdisc (排队规则)，这是挂载 TC BPF 程序的先决条件
-		//    `tc qdisc add dev <iface> clsact`
-		//    如果已经存在，它会报错，我们可以忽略这个错误
-		_ = exec.Command("tc", "qdisc", "del", "dev", iface.Name, "clsact").Run() // 先尝试删除，确保一个干净的状态
-		cmdAddQdisc := exec.Command("tc", "qdisc", "add", "dev", iface.Name, "clsact")
-		if out, err := cmdAddQdisc.CombinedOutput(); err != nil {
-			log.Printf("Failed to add qdisc to interface %s: %v. Output: %s", iface.Name, err, string(out))
-			continue
+		a, err := attachRoutes(objs.InjectToaLwt, prefixes, *routeTable)
+		if err != nil {
+			log.Fatalf("Failed to attach lwt program: %v", err)
 		}
+		log.Printf("Successfully attached lwt program to %d routes in table %d", len(prefixes), *routeTable)
+		targets = a.targets
+		detach = func(keep bool) {
+			if keep {
+				a.Release()
+				return
+			}
+			log.Printf("Detaching from routes")
+			a.Detach()
+		}
+	default:
+		// 订阅网卡变化，热插拔的网卡、新建的 bond 和容器 veth 在出现后立即挂载。
+		// 挂载在进程内通过 TCX 或 netlink 完成，不再 fork tc 命令
+		prog, devMode := objs.InjectTcpOption, mode
+		switch cfg.engine {
+		case engineXDP:
+			// XDP 引擎挂在选中网卡的入口，这些网卡同时也是重定向的出口
+			prog, devMode = objs.InjectToaXdp, attachModeXDP
+		case engineTCIngress:
+			prog = objs.InjectToaIngress
+		}
+		att := newAttacher(prog, devMode, cfg.pinDir)
+		// txPorts 只在 XDP 模式下使用
+		att.txPorts = objs.TxPorts
+		att.ingress = cfg.engine == engineTCIngress
+		w := newLinkWatcher(att, &sel)
+		if err := w.start(); err != nil {
+			log.Fatalf("Failed to watch network interfaces: %v", err)
+		}
+		if len(w.targets()) == 0 {
+			log.Printf("No interface matches the selection rules yet, waiting for new links")
+		}
+		targets, detach = w.targets, w.stop
+	}
+	if len(proxyHooks) > 0 {
+		detachEngine := detach
+		detach = func(keep bool) {
+			detachEngine(keep)
+			for _, h := range proxyHooks {
+				if keep {
+					h.Release()
+				} else if err := h.Detach(); err != nil {
+					log.Printf("Failed to detach proxy address hook: %v", err)
+				}
+			}
+		}
+	}
 
-		// 2. 附加 BPF 程序到 egress (出口) hook
-		//    命令: tc filter add dev <iface> egress bpf direct-action object-file <file.o> section <sec_name>
-		cmdAttachEgress := exec.Command("tc", "filter", "add", "dev", iface.Name, "egress", "bpf", "direct-action", "object-file", objFileName, "section", "tc")
-		if out, err := cmdAttachEgress.CombinedOutput(); err != nil {
-			log.Printf("Failed to attach BPF program to egress on %s: %v. Output: %s", iface.Name, err, string(out))
-			// 如果附加失败，清理掉刚刚创建的 qdisc
-			exec.Command("tc", "qdisc", "del", "dev", iface.Name, "clsact").Run()
-			continue
+	var rt *runtimeSampler
+	if *runtimeStats {
+		closer, err := enableRuntimeStats()
+		if err != nil {
+			log.Fatalf("Failed to enable runtime stats: %v", err)
 		}
+		defer closer.Close()
 
-		log.Printf("Successfully attached TC program to egress of interface %q", iface.Name)
-		attachedInterfaces = append(attachedInterfaces, iface.Name)
+		name, prog := programPin(cfg.engine, &objs)
+		var pin string
+		if cfg.pinDir != "" {
+			pin = filepath.Join(cfg.pinDir, name)
+		}
+		rt = newRuntimeSampler(prog, pin)
 	}
 
-	if len(attachedInterfaces) == 0 {
-		log.Fatalf("Could not attach to any suitable network interfaces. Please ensure you are running as root or with CAP_NET_ADMIN capabilities.")
+	if cfg.enableStats && *statsInterval > 0 {
+		go logStats(newStatsReader(objs.Stats, uint32(cfg.statsSlots)), targets, *statsInterval, rt)
 	}
 
-	// 启动一个 goroutine 来等待停止信号
-	go func() {
-		<-stopper
-		log.Println("Received shutdown signal, cleaning up and exiting...")
+	if *metricsAddr != "" {
+		// 指标和日志各用一个 statsReader，它们的缓冲区不能共用
+		metrics := newMetricsServer(cfg, newStatsReader(objs.Stats, uint32(cfg.statsSlots)), targets, rt, metricMaps(&objs, cfg))
+		ln, err := metrics.listen(*metricsAddr)
+		if err != nil {
+			log.Fatalf("Failed to start metrics endpoint: %v", err)
+		}
+		defer ln.Close()
+		log.Printf("Serving metrics on %s/metrics", *metricsAddr)
+	}
 
-		// 程序退出时，清理所有附加的 TC 规则和 qdisc
-		for _, ifaceName := range attachedInterfaces {
-			log.Printf("Detaching from interface %s", ifaceName)
-			// 删除 qdisc 会自动删除附加在上面的所有 filter
-			if err := exec.Command("tc", "qdisc", "del", "dev", ifaceName, "clsact").Run(); err != nil {
-				log.Printf("Failed to delete qdisc on %s: %v", ifaceName, err)
+	log.Println("eBPF injector is running. Press Ctrl-C to exit.")
+	// 阻塞主goroutine，直到收到停止信号
+	for running := true; running; {
+		select {
+		case <-reload:
+			if !cfg.enablePolicy {
+				continue
+			}
+			// 文件有错误时保留当前生效的策略
+			if err := applyPolicy(objs.Policy, *policyFile); err != nil {
+				log.Printf("Failed to reload policy, keeping the current one: %v", err)
 			}
+		case <-stopper:
+			running = false
 		}
-		os.Exit(0)
-	}()
+	}
+	log.Println("Received shutdown signal, cleaning up and exiting...")
 
-	log.Println("eBPF injector is running. Press Ctrl-C to exit.")
-	// 阻塞主goroutine，让程序持续运行
-	select {}
-}
\ No newline at end of file
+	// 固定了对象时默认保留挂载，滚动升级期间 SYN 始终经过程序处理，计数也不会丢失；
+	// 否则卸载所有网卡 (或 cgroup) 上的程序
+	keep := *keepOnExit && cfg.pinDir != ""
+	if keep {
+		log.Printf("Leaving the datapath attached; pinned objects are kept in %s", cfg.pinDir)
+	}
+	detach(keep)
+	if !keep && cfg.pinDir != "" {
+		if err := os.RemoveAll(cfg.pinDir); err != nil {
+			log.Printf("Failed to remove %s: %v", cfg.pinDir, err)
+		}
+	}
+}
+
+// applyPolicy 读取策略文件并同步到内核
+func applyPolicy(m *ebpf.Map, path string) error {
+	entries, err := loadPolicyFile(path)
+	if err != nil {
+		return fmt.Errorf("load %s: %w", path, err)
+	}
+	removed, err := syncPolicy(m, entries)
+	if err != nil {
+		return fmt.Errorf("apply %s: %w", path, err)
+	}
+	log.Printf("Policy %s applied: %d prefixes, %d removed", path, len(entries), removed)
+	return nil
+}
@@ -0,0 +1,201 @@
+package main
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"log"
+	"net"
+	"net/http"
+	"os"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/cilium/ebpf"
+)
+
+// metricsServer 以 Prometheus 文本格式导出计数、程序耗时、map 占用和挂载状态。
+// 指标在抓取时直接从内核读取，不在后台定时缓存
+type metricsServer struct {
+	cfg     datapathConfig
+	targets func() map[string]target
+	runtime *runtimeSampler
+	// maps 是导出容量和表项数的 map，按名字索引
+	maps map[string]*ebpf.Map
+
+	// mu 保护 stats 和 buf，抓取请求串行处理
+	mu    sync.Mutex
+	stats *statsReader
+	buf   bytes.Buffer
+}
+
+func newMetricsServer(cfg datapathConfig, stats *statsReader, targets func() map[string]target, rt *runtimeSampler,
+	maps map[string]*ebpf.Map) *metricsServer {
+	return &metricsServer{cfg: cfg, stats: stats, targets: targets, runtime: rt, maps: maps}
+}
+
+// listen 在 addr 上提供 /metrics。addr 为 "unix:<path>" 时监听 unix socket，否则监听 TCP
+func (s *metricsServer) listen(addr string) (net.Listener, error) {
+	network := "tcp"
+	if path, ok := strings.CutPrefix(addr, "unix:"); ok {
+		network, addr = "unix", path
+		// 上一个进程留下的 socket 文件
+		if err := os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+			return nil, err
+		}
+	}
+	ln, err := net.Listen(network, addr)
+	if err != nil {
+		return nil, err
+	}
+
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", s)
+	go func() {
+		if err := http.Serve(ln, mux); err != nil && !errors.Is(err, net.ErrClosed) {
+			log.Printf("Metrics server stopped: %v", err)
+		}
+	}()
+	return ln, nil
+}
+
+func (s *metricsServer) ServeHTTP(w http.ResponseWriter, _ *http.Request) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	start := time.Now()
+	s.buf.Reset()
+	if err := s.write(&s.buf); err != nil {
+		http.Error(w, err.Error(), http.StatusInternalServerError)
+		return
+	}
+	writeHeader(&s.buf, "ebpf_injector_scrape_duration_seconds", "gauge", "Time spent collecting these metrics.")
+	fmt.Fprintf(&s.buf, "ebpf_injector_scrape_duration_seconds %g\n", time.Since(start).Seconds())
+
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	w.Write(s.buf.Bytes())
+}
+
+func (s *metricsServer) write(b *bytes.Buffer) error {
+	targets := s.targets()
+	names := make([]string, 0, len(targets))
+	for name := range targets {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+
+	writeHeader(b, "ebpf_injector_attached", "gauge", "Attachment points carrying the datapath program, by attach mode.")
+	for _, name := range names {
+		fmt.Fprintf(b, "ebpf_injector_attached{interface=%q,mode=%q} 1\n", labelValue(name), targets[name].mode)
+	}
+
+	if s.cfg.enableStats {
+		slots := make([]int, 0, len(targets))
+		for _, name := range names {
+			slots = append(slots, targets[name].slot)
+		}
+		counts, err := s.stats.readMany(slots)
+		if err != nil {
+			return err
+		}
+		writeHeader(b, "ebpf_injector_packets_total", "counter", "Packets handled by the datapath, by interface and exit reason.")
+		for _, name := range names {
+			st := counts[targets[name].slot]
+			for i, c := range st.Count {
+				fmt.Fprintf(b, "ebpf_injector_packets_total{interface=%q,reason=%q} %d\n", labelValue(name), statReasons[i], c)
+			}
+		}
+		writeHeader(b, "ebpf_injector_injected_total", "counter", "SYNs that received a TOA option, by interface.")
+		for _, name := range names {
+			st := counts[targets[name].slot]
+			fmt.Fprintf(b, "ebpf_injector_injected_total{interface=%q} %d\n", labelValue(name), st.injected())
+		}
+	}
+
+	if s.runtime != nil {
+		if rt, _, err := s.runtime.totals(); err == nil {
+			writeHeader(b, "ebpf_injector_program_runs_total", "counter", "Program invocations counted by BPF_ENABLE_STATS.")
+			fmt.Fprintf(b, "ebpf_injector_program_runs_total %d\n", rt.runs)
+			writeHeader(b, "ebpf_injector_program_run_time_seconds_total", "counter", "Kernel time spent in the program counted by BPF_ENABLE_STATS.")
+			fmt.Fprintf(b, "ebpf_injector_program_run_time_seconds_total %g\n", rt.runTime.Seconds())
+		}
+	}
+
+	s.writeMaps(b)
+	return nil
+}
+
+// writeMaps 导出 map 的容量和当前表项数。表项数在抓取时遍历内核中的 map 得到，
+// 其他进程 (例如另一个实例重新加载了策略) 修改过的 map 也如实反映；数组 map 的表项总是满的，只导出容量
+func (s *metricsServer) writeMaps(b *bytes.Buffer) {
+	names := make([]string, 0, len(s.maps))
+	for name := range s.maps {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+
+	writeHeader(b, "ebpf_injector_map_max_entries", "gauge", "Capacity of the datapath maps as reported by the kernel.")
+	for _, name := range names {
+		fmt.Fprintf(b, "ebpf_injector_map_max_entries{map=%q} %d\n", name, s.maps[name].MaxEntries())
+	}
+	writeHeader(b, "ebpf_injector_map_entries", "gauge", "Entries in the datapath maps, counted in the kernel at scrape time.")
+	for _, name := range names {
+		m := s.maps[name]
+		if m.Type() == ebpf.Array || m.Type() == ebpf.PerCPUArray {
+			continue
+		}
+		n, err := mapEntries(m)
+		if err != nil {
+			log.Printf("Failed to count entries of map %s: %v", name, err)
+			continue
+		}
+		fmt.Fprintf(b, "ebpf_injector_map_entries{map=%q} %d\n", name, n)
+	}
+}
+
+// mapEntries 用 BPF_MAP_GET_NEXT_KEY 遍历 map 统计表项数，每个表项一次系统调用。
+// 遍历期间表项被删除时内核会从头开始，所以最多数到 map 的容量为止
+func mapEntries(m *ebpf.Map) (int, error) {
+	key := make([]byte, m.KeySize())
+	next := make([]byte, m.KeySize())
+	var prev interface{}
+	n := 0
+	for n < int(m.MaxEntries()) {
+		if err := m.NextKey(prev, next); err != nil {
+			if errors.Is(err, ebpf.ErrKeyNotExist) {
+				break
+			}
+			return 0, err
+		}
+		n++
+		copy(key, next)
+		prev = key
+	}
+	return n, nil
+}
+
+// metricMaps 返回当前配置下数据面实际使用的 map。proxy_clients 是 socket 存储，无法遍历，不导出
+func metricMaps(objs *bpfObjects, cfg datapathConfig) map[string]*ebpf.Map {
+	maps := map[string]*ebpf.Map{"stats": objs.Stats}
+	if cfg.enablePolicy {
+		maps["policy"] = objs.Policy
+	}
+	if cfg.proxyAddr && cfg.engine != engineSockops {
+		maps["proxy_cookies"] = objs.ProxyCookies
+	}
+	if cfg.engine == engineXDP {
+		maps["tx_ports"] = objs.TxPorts
+	}
+	return maps
+}
+
+func writeHeader(b *bytes.Buffer, name, typ, help string) {
+	fmt.Fprintf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, typ)
+}
+
+// labelValue 去掉网卡名中不可能出现、但会破坏格式的字符；%q 负责转义引号和反斜杠
+func labelValue(s string) string {
+	return strings.ToValidUTF8(s, "")
+}
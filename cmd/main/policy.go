@@ -0,0 +1,155 @@
+package main
+
+import (
+	"bufio"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"os"
+	"strconv"
+	"strings"
+
+	"github.com/cilium/ebpf"
+)
+
+// policyKey 对应 C 中的 struct policy_key。IPv4 前缀以 IPv4-mapped IPv6 形式存放
+type policyKey struct {
+	PrefixLen uint32
+	Addr      [16]byte
+}
+
+func (k policyKey) String() string {
+	ip := net.IP(k.Addr[:])
+	if ip.To4() != nil && k.PrefixLen >= 96 {
+		return fmt.Sprintf("%s/%d", ip, k.PrefixLen-96)
+	}
+	return fmt.Sprintf("%s/%d", ip, k.PrefixLen)
+}
+
+// policyValue 对应 C 中的 struct policy_value，端口为主机字节序的闭区间
+type policyValue struct {
+	PortMin uint16
+	PortMax uint16
+}
+
+// parsePolicy 读取策略文件。每行一条规则，格式为
+//
+//	<CIDR> [port | port-port]
+//
+// 例如 "10.0.0.0/8"、"10.1.0.0/16 8000-8999"、"2001:db8::/32 443"。
+// 空行和 # 开头的注释会被忽略
+func parsePolicy(r io.Reader) (map[policyKey]policyValue, error) {
+	entries := make(map[policyKey]policyValue)
+	sc := bufio.NewScanner(r)
+	for lineno := 1; sc.Scan(); lineno++ {
+		line := sc.Text()
+		if i := strings.IndexByte(line, '#'); i >= 0 {
+			line = line[:i]
+		}
+		fields := strings.Fields(line)
+		if len(fields) == 0 {
+			continue
+		}
+		if len(fields) > 2 {
+			return nil, fmt.Errorf("line %d: too many fields", lineno)
+		}
+
+		key, err := policyKeyFromCIDR(fields[0])
+		if err != nil {
+			return nil, fmt.Errorf("line %d: %w", lineno, err)
+		}
+		val := policyValue{PortMin: 0, PortMax: 65535}
+		if len(fields) == 2 {
+			if val, err = parsePortRange(fields[1]); err != nil {
+				return nil, fmt.Errorf("line %d: %w", lineno, err)
+			}
+		}
+		if _, dup := entries[key]; dup {
+			return nil, fmt.Errorf("line %d: duplicate prefix %s", lineno, fields[0])
+		}
+		entries[key] = val
+	}
+	return entries, sc.Err()
+}
+
+func policyKeyFromCIDR(s string) (policyKey, error) {
+	_, ipnet, err := net.ParseCIDR(s)
+	if err != nil {
+		return policyKey{}, err
+	}
+	return policyKeyFromIPNet(ipnet), nil
+}
+
+func policyKeyFromIPNet(ipnet *net.IPNet) policyKey {
+	var key policyKey
+	ones, _ := ipnet.Mask.Size()
+	copy(key.Addr[:], ipnet.IP.To16())
+	key.PrefixLen = uint32(ones)
+	if ipnet.IP.To4() != nil {
+		// To16 已经生成 ::ffff:a.b.c.d，前缀长度加上 96 位的映射前缀
+		key.PrefixLen += 96
+	}
+	return key
+}
+
+func parsePortRange(s string) (policyValue, error) {
+	lo, hi, found := strings.Cut(s, "-")
+	if !found {
+		hi = lo
+	}
+	first, err := strconv.ParseUint(lo, 10, 16)
+	if err != nil {
+		return policyValue{}, fmt.Errorf("invalid port %q", lo)
+	}
+	last, err := strconv.ParseUint(hi, 10, 16)
+	if err != nil {
+		return policyValue{}, fmt.Errorf("invalid port %q", hi)
+	}
+	if first > last {
+		return policyValue{}, fmt.Errorf("invalid port range %q", s)
+	}
+	return policyValue{PortMin: uint16(first), PortMax: uint16(last)}, nil
+}
+
+func loadPolicyFile(path string) (map[policyKey]policyValue, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	return parsePolicy(f)
+}
+
+// syncPolicy 让 policy map 与 entries 保持一致：先写入全部规则，再删除多余的规则，
+// 更新过程中数据面始终能查到旧规则或新规则之一。
+// LPM 的用户态查找也是最长前缀匹配，无法用来判断某个前缀是否已存在，所以规则总是重写
+func syncPolicy(m *ebpf.Map, entries map[policyKey]policyValue) (removed int, err error) {
+	for k, v := range entries {
+		if err := m.Put(&k, &v); err != nil {
+			return removed, fmt.Errorf("update %s: %w", k, err)
+		}
+	}
+
+	var (
+		k     policyKey
+		v     policyValue
+		stale []policyKey
+	)
+	iter := m.Iterate()
+	for iter.Next(&k, &v) {
+		if _, ok := entries[k]; !ok {
+			stale = append(stale, k)
+		}
+	}
+	if err := iter.Err(); err != nil {
+		return removed, fmt.Errorf("iterate policy: %w", err)
+	}
+	for _, k := range stale {
+		if err := m.Delete(&k); err != nil && !errors.Is(err, ebpf.ErrKeyNotExist) {
+			return removed, fmt.Errorf("delete %s: %w", k, err)
+		}
+		removed++
+	}
+	return removed, nil
+}
@@ -0,0 +1,92 @@
+package main
+
+import (
+	"fmt"
+	"io"
+	"time"
+
+	"github.com/cilium/ebpf"
+	"golang.org/x/sys/unix"
+)
+
+// enableRuntimeStats 打开内核的 BPF 运行时统计 (BPF_ENABLE_STATS)。
+// 打开后每次程序执行都会多两次取时钟，返回的 io.Closer 关闭时统计随之关闭
+func enableRuntimeStats() (io.Closer, error) {
+	c, err := ebpf.EnableStats(uint32(unix.BPF_STATS_RUN_TIME))
+	if err != nil {
+		return nil, fmt.Errorf("enable BPF runtime stats: %w", err)
+	}
+	return c, nil
+}
+
+// runtimeSample 是两次采样之间程序的执行次数和累计耗时
+type runtimeSample struct {
+	runs    uint64
+	runTime time.Duration
+}
+
+// nsPerRun 返回平均每次执行的耗时
+func (s runtimeSample) nsPerRun() float64 {
+	if s.runs == 0 {
+		return 0
+	}
+	return float64(s.runTime.Nanoseconds()) / float64(s.runs)
+}
+
+// runtimeSampler 定期读取程序信息中的 run_time_ns/run_cnt。
+// 所有网卡共享同一个程序，内核只按程序统计；每个网卡的开销由它的报文数乘以平均耗时估算
+type runtimeSampler struct {
+	prog *ebpf.Program
+	// pin 是程序的固定文件，为空时只读取 prog
+	pin string
+
+	lastID   ebpf.ProgramID
+	lastRuns uint64
+	lastTime time.Duration
+}
+
+func newRuntimeSampler(prog *ebpf.Program, pin string) *runtimeSampler {
+	return &runtimeSampler{prog: prog, pin: pin}
+}
+
+// program 返回当前生效的程序。upgrade 会替换固定的程序，所以优先读取固定的版本
+func (s *runtimeSampler) program() (*ebpf.Program, func()) {
+	if s.pin != "" {
+		if p, err := ebpf.LoadPinnedProgram(s.pin, nil); err == nil {
+			return p, func() { p.Close() }
+		}
+	}
+	return s.prog, func() {}
+}
+
+// totals 返回当前生效程序的累计执行次数、累计耗时和程序 ID
+func (s *runtimeSampler) totals() (runtimeSample, ebpf.ProgramID, error) {
+	prog, release := s.program()
+	defer release()
+
+	info, err := prog.Info()
+	if err != nil {
+		return runtimeSample{}, 0, fmt.Errorf("program info: %w", err)
+	}
+	runs, ok1 := info.RunCount()
+	runTime, ok2 := info.Runtime()
+	if !ok1 || !ok2 {
+		return runtimeSample{}, 0, fmt.Errorf("kernel does not report program run time")
+	}
+	id, _ := info.ID()
+	return runtimeSample{runs: runs, runTime: runTime}, id, nil
+}
+
+// sample 返回自上次采样以来的增量。程序被替换后从新程序的计数重新开始
+func (s *runtimeSampler) sample() (runtimeSample, error) {
+	cur, id, err := s.totals()
+	if err != nil {
+		return runtimeSample{}, err
+	}
+	if id != s.lastID {
+		s.lastID, s.lastRuns, s.lastTime = id, 0, 0
+	}
+	d := runtimeSample{runs: cur.runs - s.lastRuns, runTime: cur.runTime - s.lastTime}
+	s.lastRuns, s.lastTime = cur.runs, cur.runTime
+	return d, nil
+}
@@ -0,0 +1,56 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"log"
+	"os"
+	"path/filepath"
+
+	"github.com/cilium/ebpf"
+)
+
+// 代理设置客户端地址的接口与接收端 getsockopt 返回的 struct toa_addr 相同 (20 字节):
+//
+//	struct { __be16 port; __u16 family; __u8 addr[16]; }
+//
+// IPv4 地址以 IPv4-mapped 形式 (::ffff:a.b.c.d) 放在 addr 中。代理在 connect() 之前调用
+// setsockopt(fd, IPPROTO_TCP, -proxy-sockopt, &addr, sizeof(addr))，之后的 SYN 携带这个地址，
+// 代替 PROXY protocol 的额外报文和解析
+
+// proxyHook 是代理地址需要的一个 cgroup 钩子
+type proxyHook struct {
+	prog *ebpf.Program
+	typ  ebpf.AttachType
+	pin  string
+}
+
+// attachProxyHooks 在 cgroup 上挂载 setsockopt 钩子，TC 引擎还需要按 cookie 复制地址的 sockops 程序。
+// 未启用 -proxy-addr 时删除上次运行固定的 link，否则它们会继续拦截 setsockopt
+func attachProxyHooks(objs *bpfObjects, cfg datapathConfig, cgroup string) ([]*cgroupAttachment, error) {
+	hooks := []proxyHook{
+		{objs.SetClientAddr, ebpf.AttachCGroupSetsockopt, setsockoptLinkPin},
+		{objs.ProxyAddrSockops, ebpf.AttachCGroupSockOps, proxySockopsLinkPin},
+	}
+	var attached []*cgroupAttachment
+	for _, h := range hooks {
+		if h.prog == nil {
+			if cfg.pinDir == "" {
+				continue
+			}
+			if err := os.Remove(filepath.Join(cfg.pinDir, h.pin)); err != nil && !errors.Is(err, os.ErrNotExist) {
+				log.Printf("Failed to remove %s: %v", h.pin, err)
+			}
+			continue
+		}
+		a, err := attachCgroupHook(h.prog, cgroup, h.typ, cfg.pinDir, h.pin)
+		if err != nil {
+			for _, a := range attached {
+				a.Detach()
+			}
+			return nil, fmt.Errorf("attach proxy address hook: %w", err)
+		}
+		attached = append(attached, a)
+	}
+	return attached, nil
+}
@@ -0,0 +1,144 @@
+package main
+
+import (
+	"errors"
+	"flag"
+	"fmt"
+	"log"
+	"os"
+	"os/signal"
+	"path/filepath"
+	"syscall"
+	"time"
+
+	"github.com/cilium/ebpf"
+	"github.com/cilium/ebpf/rlimit"
+)
+
+// receiverStatNames 与 bpf_toa_receiver_kern.c 中 enum receiver_stat 的顺序一致
+var receiverStatNames = []string{"stored", "no_toa", "no_storage", "peername_rewritten", "sockopt_served", "syncookie", "syn_kept"}
+
+// receiverStoragePin 是 socket 存储 map 的固定文件名。应用以自己的 socket fd 为 key 查询
+// <pin-dir>/toa_storage，一次 bpf 系统调用即可得到 struct toa_addr
+const receiverStoragePin = "toa_storage"
+
+// receiverHook 是把地址交给应用的一个 cgroup 钩子
+type receiverHook struct {
+	enabled bool
+	prog    *ebpf.Program
+	typ     ebpf.AttachType
+	pin     string
+}
+
+// runReceiver 是 `ebpf-injector receiver` 子命令的入口，在后端服务器上运行：
+// 把 toa_receiver 挂到 cgroup，从被动连接的 SYN 中取出 TOA 地址存进 socket 存储
+func runReceiver(args []string) {
+	fs := flag.NewFlagSet("receiver", flag.ExitOnError)
+	cgroupPath := fs.String("cgroup", "/sys/fs/cgroup", "cgroup v2 directory whose listening sockets get the client address")
+	pinDir := fs.String("pin-dir", "/sys/fs/bpf/ebpf-injector-receiver", "bpffs directory for the pinned socket storage map and cgroup link; must not be inside the injector's -pin-dir")
+	kindV4 := fs.Uint("toa-kind", 254, "TCP option kind of the IPv4 TOA option")
+	kindV6 := fs.Uint("toa-kind-v6", 253, "TCP option kind of the IPv6 TOA option")
+	getpeername := fs.Bool("getpeername", true, "make getpeername() return the client address carried in TOA, so unmodified servers log the real client")
+	sockopt := fs.Uint("sockopt", 254, "getsockopt(IPPROTO_TCP, <n>) returns the client address as struct toa_addr; 0 disables")
+	statsInterval := fs.Duration("stats-interval", time.Minute, "interval for logging receiver counters, 0 to disable")
+	fs.Parse(args)
+
+	if err := rlimit.RemoveMemlock(); err != nil {
+		log.Fatalf("Failed to remove memlock limit: %v", err)
+	}
+
+	objs := receiverObjects{}
+	if err := loadReceiverDatapath(uint8(*kindV4), uint8(*kindV6), uint32(*sockopt), *pinDir, &objs); err != nil {
+		log.Fatalf("Failed to load receiver objects: %v", err)
+	}
+	defer objs.Close()
+
+	// 先挂取地址的钩子，sockops 开始保存地址时应用马上就能取到
+	hooks := []receiverHook{
+		{*getpeername, objs.ToaGetpeername4, ebpf.AttachCgroupInet4GetPeername, "cgroup_getpeername4"},
+		{*getpeername, objs.ToaGetpeername6, ebpf.AttachCgroupInet6GetPeername, "cgroup_getpeername6"},
+		{*sockopt != 0, objs.ToaGetsockopt, ebpf.AttachCGroupGetsockopt, "cgroup_getsockopt"},
+	}
+	var attached []*cgroupAttachment
+	for _, h := range hooks {
+		if !h.enabled {
+			// 上次运行固定的 link 随固定文件一起卸载，否则会继续改写地址
+			if err := os.Remove(filepath.Join(*pinDir, h.pin)); err != nil && !errors.Is(err, os.ErrNotExist) {
+				log.Printf("Failed to remove %s: %v", h.pin, err)
+			}
+			continue
+		}
+		a, err := attachCgroupHook(h.prog, *cgroupPath, h.typ, *pinDir, h.pin)
+		if err != nil {
+			log.Fatalf("Failed to attach receiver hook: %v", err)
+		}
+		attached = append(attached, a)
+	}
+	a, err := attachCgroup(objs.ToaReceiver, *cgroupPath, *pinDir)
+	if err != nil {
+		log.Fatalf("Failed to attach receiver: %v", err)
+	}
+	attached = append(attached, a)
+	log.Printf("Receiver attached to cgroup %s; client addresses are in %s/%s", *cgroupPath, *pinDir, receiverStoragePin)
+
+	if *statsInterval > 0 {
+		go logReceiverStats(objs.ReceiverStats, *statsInterval)
+	}
+
+	stopper := make(chan os.Signal, 1)
+	signal.Notify(stopper, os.Interrupt, syscall.SIGTERM)
+	<-stopper
+
+	// 与守护进程一致，固定的 link 留在 cgroup 上，重启期间新连接的地址不会丢失
+	for _, a := range attached {
+		a.Release()
+	}
+}
+
+// loadReceiverDatapath 加载接收端对象，socket 存储 map 按名字固定在 pinDir 下供应用查询
+// 所有钩子一起加载: 接收端本身需要 5.10 的 bpf_load_hdr_opt，getpeername (5.8) 和 getsockopt (5.3) 钩子一定可用
+func loadReceiverDatapath(kindV4, kindV6 uint8, sockopt uint32, pinDir string, objs *receiverObjects) error {
+	for _, k := range []uint8{kindV4, kindV6} {
+		if k < 2 {
+			return fmt.Errorf("invalid TCP option kind %d", k)
+		}
+	}
+	spec, err := loadReceiver()
+	if err != nil {
+		return err
+	}
+	if err := spec.RewriteConstants(map[string]interface{}{
+		"toa_kind":    kindV4,
+		"toa_kind_v6": kindV6,
+		"toa_sockopt": sockopt,
+	}); err != nil {
+		return fmt.Errorf("rewrite constants: %w", err)
+	}
+	if err := os.MkdirAll(pinDir, 0o755); err != nil {
+		return fmt.Errorf("create pin dir: %w", err)
+	}
+	spec.Maps[receiverStoragePin].Pinning = ebpf.PinByName
+	return spec.LoadAndAssign(objs, &ebpf.CollectionOptions{Maps: ebpf.MapOptions{PinPath: pinDir}})
+}
+
+func logReceiverStats(m *ebpf.Map, interval time.Duration) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+
+	var perCPU []uint64
+	for range ticker.C {
+		line := ""
+		for i, name := range receiverStatNames {
+			if err := m.Lookup(uint32(i), &perCPU); err != nil {
+				log.Printf("Failed to read receiver stats: %v", err)
+				break
+			}
+			var sum uint64
+			for _, c := range perCPU {
+				sum += c
+			}
+			line += fmt.Sprintf(" %s=%d", name, sum)
+		}
+		log.Printf("receiver stats:%s", line)
+	}
+}
@@ -0,0 +1,176 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"net"
+	"strings"
+	"time"
+
+	"github.com/cilium/ebpf"
+	"github.com/vishvananda/netlink"
+	"github.com/vishvananda/netlink/nl"
+)
+
+// routeProtocol 是 LWT 引擎新建路由的 rtm_protocol，iproute2 没有登记这个值。
+// 卸载时只删除带这个标记的路由，原本就存在的路由只去掉 encap
+const routeProtocol = 250
+
+// parseRoutePrefixes 解析 -routes 中逗号分隔的后端网段
+func parseRoutePrefixes(s string) ([]*net.IPNet, error) {
+	var prefixes []*net.IPNet
+	for _, f := range strings.Split(s, ",") {
+		f = strings.TrimSpace(f)
+		if f == "" {
+			continue
+		}
+		_, dst, err := net.ParseCIDR(f)
+		if err != nil {
+			return nil, fmt.Errorf("invalid route prefix %q: %w", f, err)
+		}
+		prefixes = append(prefixes, dst)
+	}
+	if len(prefixes) == 0 {
+		return nil, fmt.Errorf("no route prefix given")
+	}
+	return prefixes, nil
+}
+
+// routeAttachment 是 LWT 程序在一组路由上的挂载
+type routeAttachment struct {
+	routes []netlink.Route
+	// devs 是路由的出口网卡名到 ifindex 的映射，程序的计数记在出口网卡的槽位上
+	devs map[string]int
+}
+
+// attachRoutes 把 prog 作为 LWT xmit 程序挂到 table 中去往 prefixes 的路由上。
+// 已有同前缀的路由时保留它的下一跳，用 RouteReplace 原子地加上 encap；没有时按当前到达该网段的
+// 下一跳新建一条路由。上一个进程留下的路由同样被原地替换，切换期间路由一直有效
+func attachRoutes(prog *ebpf.Program, prefixes []*net.IPNet, table int) (*routeAttachment, error) {
+	a := &routeAttachment{devs: make(map[string]int)}
+	for _, dst := range prefixes {
+		r, err := lwtRoute(prog, dst, table)
+		if err == nil {
+			err = netlink.RouteReplace(r)
+		}
+		if err != nil {
+			a.Detach()
+			return nil, fmt.Errorf("attach to route %s: %w", dst, err)
+		}
+		a.routes = append(a.routes, *r)
+		a.devs[linkName(r.LinkIndex)] = r.LinkIndex
+	}
+	return a, nil
+}
+
+// lwtRoute 返回去往 dst 的路由挂上 prog 之后的样子
+func lwtRoute(prog *ebpf.Program, dst *net.IPNet, table int) (*netlink.Route, error) {
+	encap := &netlink.BpfEncap{}
+	if err := encap.SetProg(nl.LWT_BPF_XMIT, prog.FD(), lwtProgramPin); err != nil {
+		return nil, err
+	}
+	existing, err := findRoute(dst, table)
+	if err != nil {
+		return nil, err
+	}
+	if existing != nil {
+		r := *existing
+		r.Encap = encap
+		return &r, nil
+	}
+
+	hops, err := netlink.RouteGet(dst.IP)
+	if err != nil {
+		return nil, fmt.Errorf("look up next hop: %w", err)
+	}
+	if len(hops) == 0 {
+		return nil, fmt.Errorf("no route to %s", dst.IP)
+	}
+	return &netlink.Route{
+		Dst:       dst,
+		Gw:        hops[0].Gw,
+		LinkIndex: hops[0].LinkIndex,
+		Table:     table,
+		Protocol:  routeProtocol,
+		Encap:     encap,
+	}, nil
+}
+
+// findRoute 返回 table 中目的前缀恰好是 dst 的路由，没有时返回 nil
+func findRoute(dst *net.IPNet, table int) (*netlink.Route, error) {
+	family := netlink.FAMILY_V4
+	if dst.IP.To4() == nil {
+		family = netlink.FAMILY_V6
+	}
+	routes, err := netlink.RouteListFiltered(family, &netlink.Route{Dst: dst, Table: table},
+		netlink.RT_FILTER_DST|netlink.RT_FILTER_TABLE)
+	if err != nil {
+		return nil, fmt.Errorf("list routes to %s: %w", dst, err)
+	}
+	if len(routes) == 0 {
+		return nil, nil
+	}
+	return &routes[0], nil
+}
+
+func (a *routeAttachment) Mode() attachMode { return attachModeLWT }
+
+// Detach 删除本程序新建的路由，其余路由去掉 encap，恢复成挂载之前的样子
+func (a *routeAttachment) Detach() error {
+	var first error
+	for i := range a.routes {
+		r := a.routes[i]
+		var err error
+		if r.Protocol == routeProtocol {
+			err = netlink.RouteDel(&r)
+		} else {
+			r.Encap = nil
+			err = netlink.RouteReplace(&r)
+		}
+		if err != nil {
+			log.Printf("Failed to restore route to %s: %v", r.Dst, err)
+			if first == nil {
+				first = err
+			}
+		}
+	}
+	return first
+}
+
+// Release 什么也不做：路由持有程序的引用，进程退出后程序继续生效，下一个进程替换路由即可接管
+func (a *routeAttachment) Release() error { return nil }
+
+// targets 返回挂载了程序的出口网卡，同一网卡上的多条路由共用一个计数槽位
+func (a *routeAttachment) targets() map[string]target {
+	t := make(map[string]target, len(a.devs))
+	for name, ifindex := range a.devs {
+		t[name] = target{slot: ifindex, mode: attachModeLWT}
+	}
+	return t
+}
+
+// upgradeRoutes 把 table 中去往 prefixes 且已经带有 BPF encap 的路由替换为挂载 prog 的版本
+func upgradeRoutes(prog *ebpf.Program, prefixes []*net.IPNet, table int) ([]swapResult, error) {
+	var swaps []swapResult
+	for _, dst := range prefixes {
+		existing, err := findRoute(dst, table)
+		if err != nil {
+			return swaps, err
+		}
+		if existing == nil || existing.Encap == nil || existing.Encap.Type() != nl.LWTUNNEL_ENCAP_BPF {
+			continue
+		}
+		r, err := lwtRoute(prog, dst, table)
+		if err != nil {
+			return swaps, err
+		}
+		start := time.Now()
+		err = netlink.RouteReplace(r)
+		took := time.Since(start)
+		if err != nil {
+			return swaps, fmt.Errorf("replace route to %s: %w", dst, err)
+		}
+		swaps = append(swaps, swapResult{target: dst.String(), mode: attachModeLWT, took: took})
+	}
+	return swaps, nil
+}
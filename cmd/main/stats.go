@@ -0,0 +1,300 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"log"
+	"strings"
+	"time"
+
+	"github.com/cilium/ebpf"
+)
+
+// 以下常量与 bpf_tcp_option_kern.c 中 enum stat_reason 一一对应，顺序必须一致。
+// 加载时按 stats map 的 value 大小校验 statMax 与 C 侧的 STAT_MAX 相同
+const (
+	statInjectedGrow = iota
+	statInjectedCompact
+	statInjectedSockops
+	statExistingSkipped
+	statExistingRewritten
+	statPolicySkipped
+	statNotIP
+	statNotTCP
+	statNotSYN
+	statTruncated
+	statBadOptions
+	statIPv6Exthdr
+	statNoRoom
+	statHasPayload
+	statGrowFailed
+	statStoreFailed
+	statCsumFailed
+	statInjectedXDP
+	statNotForwarded
+	statForwarded
+	statVLAN
+	statQinQ
+	statVLANTooDeep
+	statTunnel
+	statFwdNoNeigh
+	statFwdNoTxPort
+	statFwdTTL
+	statFwdTruncated
+	statMax
+)
+
+// statReasons 是各计数在日志和指标中的名字，按上面的常量索引
+var statReasons = [statMax]string{
+	statInjectedGrow:      "injected_grow",
+	statInjectedCompact:   "injected_compact",
+	statInjectedSockops:   "injected_sockops",
+	statExistingSkipped:   "existing_skipped",
+	statExistingRewritten: "existing_rewritten",
+	statPolicySkipped:     "policy_skipped",
+	statNotIP:             "not_ip",
+	statNotTCP:            "not_tcp",
+	statNotSYN:            "not_syn",
+	statTruncated:         "truncated",
+	statBadOptions:        "bad_options",
+	statIPv6Exthdr:        "ipv6_exthdr",
+	statNoRoom:            "no_room",
+	statHasPayload:        "has_payload",
+	statGrowFailed:        "grow_failed",
+	statStoreFailed:       "store_failed",
+	statCsumFailed:        "csum_failed",
+	statInjectedXDP:       "injected_xdp",
+	statNotForwarded:      "not_forwarded",
+	statForwarded:         "forwarded",
+	statVLAN:              "vlan",
+	statQinQ:              "qinq",
+	statVLANTooDeep:       "vlan_too_deep",
+	statTunnel:            "tunnel",
+	statFwdNoNeigh:        "fwd_no_neigh",
+	statFwdNoTxPort:       "fwd_no_tx_port",
+	statFwdTTL:            "fwd_ttl_exceeded",
+	statFwdTruncated:      "fwd_truncated",
+}
+
+// isPathCounter 判断计数是否是路径计数。路径计数与出口原因分别记录，同一个报文会在两处各计一次
+func isPathCounter(i int) bool {
+	switch i {
+	case statForwarded, statVLAN, statQinQ, statTunnel, statFwdNoNeigh, statFwdNoTxPort, statFwdTTL, statFwdTruncated:
+		return true
+	}
+	return false
+}
+
+// datapathStats 对应 C 中的 struct datapath_stats
+type datapathStats struct {
+	Count [statMax]uint64
+}
+
+func (s *datapathStats) add(o *datapathStats) {
+	for i := range s.Count {
+		s.Count[i] += o.Count[i]
+	}
+}
+
+// injected 返回成功注入的报文数，包括 TC 引擎扩展包尾、复用填充两种方式以及 sockops 和 XDP 引擎
+func (s *datapathStats) injected() uint64 {
+	return s.Count[statInjectedGrow] + s.Count[statInjectedCompact] + s.Count[statInjectedSockops] + s.Count[statInjectedXDP]
+}
+
+// total 返回程序处理过的报文总数，每个报文只按出口原因计一次
+func (s *datapathStats) total() uint64 {
+	var n uint64
+	for i, c := range s.Count {
+		if !isPathCounter(i) {
+			n += c
+		}
+	}
+	return n
+}
+
+func (s datapathStats) String() string {
+	var b strings.Builder
+	for i, c := range s.Count {
+		if c == 0 {
+			continue
+		}
+		if b.Len() > 0 {
+			b.WriteByte(' ')
+		}
+		fmt.Fprintf(&b, "%s=%d", statReasons[i], c)
+	}
+	return b.String()
+}
+
+// target 是一个挂载点 (网卡或 cgroup) 的计数槽位和挂载方式
+type target struct {
+	slot int
+	mode attachMode
+}
+
+// statsReader 读取并汇总 per-CPU 计数。读取 per-CPU 数组不会加锁，
+// 也不会与数据面的自增操作竞争，高包速下采样不会影响热路径。
+// statsReader 复用内部缓冲区，不能在多个 goroutine 中共用
+type statsReader struct {
+	m     *ebpf.Map
+	slots uint32
+	// perCPU 复用同一块缓冲区，避免每次采样都分配内存
+	perCPU []datapathStats
+
+	// 批量读取用的缓冲区。noBatch 表示内核或库不支持 per-CPU 数组的批量读取，之后只逐个读取
+	batchKeys   []uint32
+	batchValues []datapathStats
+	noBatch     bool
+}
+
+func newStatsReader(m *ebpf.Map, slots uint32) *statsReader {
+	return &statsReader{m: m, slots: slots}
+}
+
+// read 返回 ifindex 对应网卡在所有 CPU 上的计数之和
+func (r *statsReader) read(ifindex int) (datapathStats, error) {
+	var sum datapathStats
+	slot := r.clamp(ifindex)
+	if err := r.m.Lookup(slot, &r.perCPU); err != nil {
+		return sum, fmt.Errorf("lookup stats slot %d: %w", slot, err)
+	}
+	for i := range r.perCPU {
+		sum.add(&r.perCPU[i])
+	}
+	return sum, nil
+}
+
+// readMany 返回多个槽位的计数。槽位集中在一段连续区间时用一次 BPF_MAP_LOOKUP_BATCH
+// 读出整段，避免每个网卡一次系统调用；槽位稀疏或批量读取不可用时逐个读取
+func (r *statsReader) readMany(slots []int) (map[int]datapathStats, error) {
+	out := make(map[int]datapathStats, len(slots))
+	if len(slots) == 0 {
+		return out, nil
+	}
+
+	lo, hi := r.slots, uint32(0)
+	for _, s := range slots {
+		slot := r.clamp(s)
+		if slot < lo {
+			lo = slot
+		}
+		if slot > hi {
+			hi = slot
+		}
+	}
+	// 每个 CPU 一份的值数量由第一次逐个读取得知
+	nCPU := len(r.perCPU)
+	if !r.noBatch && nCPU > 0 && int(hi-lo+1) <= 2*len(slots) {
+		if sums, err := r.batch(lo, hi, nCPU); err == nil {
+			for _, s := range slots {
+				out[s] = sums[r.clamp(s)-lo]
+			}
+			return out, nil
+		}
+		r.noBatch = true
+	}
+
+	for _, s := range slots {
+		st, err := r.read(s)
+		if err != nil {
+			return nil, err
+		}
+		out[s] = st
+	}
+	return out, nil
+}
+
+func (r *statsReader) clamp(ifindex int) uint32 {
+	if ifindex < 0 || uint32(ifindex) >= r.slots {
+		return 0
+	}
+	return uint32(ifindex)
+}
+
+// batch 批量读取 [lo, hi] 槽位并按 CPU 求和
+func (r *statsReader) batch(lo, hi uint32, nCPU int) ([]datapathStats, error) {
+	n := int(hi - lo + 1)
+	if cap(r.batchKeys) < n {
+		r.batchKeys = make([]uint32, n)
+		r.batchValues = make([]datapathStats, n*nCPU)
+	}
+	keys, values := r.batchKeys[:n], r.batchValues[:n*nCPU]
+
+	// 数组的批量读取从游标的下一个下标开始
+	var prev interface{}
+	if lo > 0 {
+		prev = lo - 1
+	}
+	var next uint32
+	got, err := r.m.BatchLookup(prev, &next, keys, values, nil)
+	if err != nil && !errors.Is(err, ebpf.ErrKeyNotExist) {
+		return nil, err
+	}
+	if got != n {
+		return nil, fmt.Errorf("batch lookup returned %d of %d slots", got, n)
+	}
+
+	sums := make([]datapathStats, n)
+	for i := range sums {
+		for c := 0; c < nCPU; c++ {
+			sums[i].add(&values[i*nCPU+c])
+		}
+	}
+	return sums, nil
+}
+
+// logStats 每隔 interval 打印一次各网卡的计数和注入速率。
+// 网卡会动态增减，每次采样前通过 ifaces 取当前的网卡列表，再用 readMany 一次读出它们的计数。
+// rt 不为 nil 时同时打印程序的内核执行耗时，并按报文数估算每个网卡占用的 CPU 时间
+func logStats(r *statsReader, ifaces func() map[string]target, interval time.Duration, rt *runtimeSampler) {
+	prev := make(map[string]datapathStats)
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+
+	for range ticker.C {
+		var nsPerRun float64
+		if rt != nil {
+			s, err := rt.sample()
+			if err != nil {
+				log.Printf("Failed to sample program run time: %v", err)
+			} else {
+				nsPerRun = s.nsPerRun()
+				log.Printf("runtime: %.0f runs/s, %.1f ns/run, %.3f%% of one CPU",
+					float64(s.runs)/interval.Seconds(), nsPerRun, 100*s.runTime.Seconds()/interval.Seconds())
+			}
+		}
+
+		current := ifaces()
+		for name := range prev {
+			if _, ok := current[name]; !ok {
+				delete(prev, name)
+			}
+		}
+		// 所有网卡的槽位一次读出，槽位连续时只需一次批量读取的系统调用
+		slots := make([]int, 0, len(current))
+		for _, t := range current {
+			slots = append(slots, t.slot)
+		}
+		counts, err := r.readMany(slots)
+		if err != nil {
+			log.Printf("Failed to read stats: %v", err)
+			continue
+		}
+		for name, t := range current {
+			cur := counts[t.slot]
+			last := prev[name]
+			prev[name] = cur
+
+			injected := cur.injected() - last.injected()
+			seen := cur.total() - last.total()
+			pps := float64(seen) / interval.Seconds()
+			if nsPerRun > 0 {
+				log.Printf("stats %s: %.0f injected/s of %.0f pkts/s, ~%.1f us/s CPU, %s",
+					name, float64(injected)/interval.Seconds(), pps, pps*nsPerRun/1e3, cur)
+				continue
+			}
+			log.Printf("stats %s: %.0f injected/s of %.0f pkts/s, %s",
+				name, float64(injected)/interval.Seconds(), pps, cur)
+		}
+	}
+}
@@ -0,0 +1,315 @@
+package main
+
+import (
+	"errors"
+	"flag"
+	"fmt"
+	"log"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/cilium/ebpf"
+	"github.com/cilium/ebpf/rlimit"
+	"github.com/vishvananda/netlink"
+)
+
+// runUpgrade 是 `ebpf-injector upgrade` 子命令的入口：加载本二进制内嵌的新程序，
+// 通过 PROG_TEST_RUN 自检后，把它原子地替换进所有已有的挂载点。
+// 新程序复用 pinDir 中已固定的 map，计数和策略不会丢失；替换期间每个报文要么经过旧程序，
+// 要么经过新程序，不存在没有程序的窗口。正在运行的守护进程之后为新网卡挂载的也是新程序。
+// 数据面参数沿用守护进程在 pinDir 中记录的配置，命令行给出不同的取值时拒绝升级
+func runUpgrade(args []string) {
+	fs := flag.NewFlagSet("upgrade", flag.ExitOnError)
+	cgroupPath := fs.String("cgroup", "/sys/fs/cgroup", "cgroup v2 directory the sockops engine and the -proxy-addr hooks are attached to")
+	routes := fs.String("routes", "", "lwt engine: backend prefixes of the running daemon's routes")
+	routeTable := fs.Int("route-table", 254, "lwt engine: routing table of the -routes routes")
+	policyFile := fs.String("policy", "", "policy file of the running daemon; only whether it is set matters, the pinned trie is reused as is; defaults to the running daemon's setting")
+	var cfg datapathConfig
+	cfg.registerFlags(fs)
+	fs.Parse(args)
+	cfg.enablePolicy = *policyFile != ""
+	cfg.strictPins = true
+
+	if cfg.pinDir == "" {
+		log.Fatalf("upgrade needs -pin-dir to find the running datapath")
+	}
+	policySet := false
+	fs.Visit(func(f *flag.Flag) { policySet = policySet || f.Name == "policy" })
+	if err := restoreConfig(fs, &cfg, policySet); errors.Is(err, os.ErrNotExist) {
+		log.Printf("The running daemon recorded no config in %s, using the command line flags", cfg.pinDir)
+	} else if err != nil {
+		log.Fatalf("Refusing to upgrade: %v", err)
+	}
+	if err := rlimit.RemoveMemlock(); err != nil {
+		log.Fatalf("Failed to remove memlock limit: %v", err)
+	}
+
+	start := time.Now()
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		log.Fatalf("Failed to load the new datapath: %v", err)
+	}
+	defer objs.Close()
+	log.Printf("Loaded and verified the new datapath in %s", time.Since(start))
+
+	var (
+		swaps []swapResult
+		err   error
+	)
+	// sockops 程序不支持 PROG_TEST_RUN，只能依赖 verifier；其他引擎替换之前先自检
+	if cfg.engine == engineSockops {
+		log.Printf("Skipping the self-check, sockops programs cannot be test-run")
+	} else {
+		if err := selfCheck(cfg); err != nil {
+			log.Fatalf("Self-check failed, the running datapath is left untouched: %v", err)
+		}
+		log.Printf("Self-check passed on %d frames", len(progBenchFrames))
+	}
+
+	// cgroup 钩子：sockops 引擎本身，以及代理地址的钩子 (与数据面共用固定的 map，一起换成新版本)
+	var hooks []proxyHook
+	if cfg.engine == engineSockops {
+		hooks = append(hooks, proxyHook{objs.InjectToaSockops, ebpf.AttachCGroupSockOps, cgroupLinkPin})
+	}
+	hooks = append(hooks,
+		proxyHook{objs.SetClientAddr, ebpf.AttachCGroupSetsockopt, setsockoptLinkPin},
+		proxyHook{objs.ProxyAddrSockops, ebpf.AttachCGroupSockOps, proxySockopsLinkPin},
+	)
+	// 替换任何挂载点之前确认所有 cgroup link 都挂在 -cgroup 上，避免只升级了一部分
+	for _, h := range hooks {
+		if h.prog == nil {
+			continue
+		}
+		if err := checkCgroupPin(h.typ, cfg.pinDir, h.pin, *cgroupPath); err != nil {
+			log.Fatalf("Refusing to upgrade: %v", err)
+		}
+	}
+
+	switch cfg.engine {
+	case engineSockops:
+		// 在下面的 cgroup 钩子中替换
+	case engineXDP:
+		swaps, err = upgradeXDP(objs.InjectToaXdp, cfg.pinDir)
+	case engineTCIngress:
+		swaps, err = upgradeTC(objs.InjectToaIngress, cfg.pinDir, true)
+	case engineLWT:
+		prefixes, perr := parseRoutePrefixes(*routes)
+		if perr != nil {
+			log.Fatalf("Invalid -routes: %v", perr)
+		}
+		swaps, err = upgradeRoutes(objs.InjectToaLwt, prefixes, *routeTable)
+	default:
+		swaps, err = upgradeTC(objs.InjectTcpOption, cfg.pinDir, false)
+	}
+	for _, h := range hooks {
+		if err != nil || h.prog == nil {
+			continue
+		}
+		var s []swapResult
+		s, err = upgradeCgroup(h.prog, h.typ, cfg.pinDir, h.pin, *cgroupPath)
+		swaps = append(swaps, s...)
+	}
+
+	var total, worst time.Duration
+	for _, s := range swaps {
+		log.Printf("Swapped %s (%s) in %s", s.target, s.mode, s.took)
+		total += s.took
+		if s.took > worst {
+			worst = s.took
+		}
+	}
+	if err != nil {
+		log.Fatalf("Upgrade failed after %d swaps: %v", len(swaps), err)
+	}
+	if len(swaps) == 0 {
+		log.Fatalf("No attachment of the running datapath found in %s", cfg.pinDir)
+	}
+
+	if err := pinProgram(&objs, cfg); err != nil {
+		log.Fatalf("Failed to pin the new program: %v", err)
+	}
+	// 新版本可能增加了参数，记录下新程序实际使用的配置
+	if err := saveConfig(fs, cfg); err != nil {
+		log.Printf("Failed to record the datapath config: %v", err)
+	}
+	log.Printf("Upgraded %d attachments: %s total, %s worst case, %s end to end",
+		len(swaps), total, worst, time.Since(start))
+}
+
+// selfCheck 另外加载一份新程序，用 bench 的报文集合检查输出，任何一个报文不符合预期都放弃升级。
+// 这份程序不使用固定的 map，自检的报文不会计入正在运行的数据面的计数和指标；
+// 它也不转发、不启用策略，返回值不取决于本机路由，注入结果不取决于正在生效的策略
+func selfCheck(cfg datapathConfig) error {
+	cfg.pinDir = ""
+	cfg.strictPins = false
+	cfg.enablePolicy = false
+	cfg.xdpRedirect = false
+	cfg.ingressRedirect = false
+	objs := bpfObjects{}
+	if err := loadDatapath(cfg, &objs); err != nil {
+		return err
+	}
+	defer objs.Close()
+
+	_, prog := programPin(cfg.engine, &objs)
+	for _, f := range progBenchFrames {
+		if err := verifyProg(prog, cfg, f); err != nil {
+			return fmt.Errorf("frame %s: %w", f.name, err)
+		}
+	}
+	return nil
+}
+
+// swapResult 记录一次替换的目标和耗时
+type swapResult struct {
+	target string
+	mode   attachMode
+	took   time.Duration
+}
+
+// upgradeTC 替换所有固定的 TCX link 和由本程序创建的 clsact filter 中的程序，
+// ingress 选择 tc-ingress 引擎的挂载点
+func upgradeTC(prog *ebpf.Program, pinDir string, ingress bool) ([]swapResult, error) {
+	var swaps []swapResult
+	prefix, typ := tcxPinPrefix, tcxAttachType(ingress)
+	if ingress {
+		prefix = tcxIngressPinPrefix
+	}
+
+	entries, err := os.ReadDir(pinDir)
+	if err != nil {
+		return nil, err
+	}
+	for _, e := range entries {
+		if !strings.HasPrefix(e.Name(), prefix) {
+			continue
+		}
+		ifindex, err := strconv.Atoi(strings.TrimPrefix(e.Name(), prefix))
+		if err != nil {
+			continue
+		}
+		l := adoptTCX(filepath.Join(pinDir, e.Name()), ifindex, typ)
+		if l == nil {
+			// 网卡已经不存在，守护进程会清理这个固定文件
+			continue
+		}
+		start := time.Now()
+		err = l.Update(prog)
+		took := time.Since(start)
+		l.Close()
+		if err != nil {
+			return swaps, fmt.Errorf("update tcx link on ifindex %d: %w", ifindex, err)
+		}
+		swaps = append(swaps, swapResult{target: linkName(ifindex), mode: attachModeTCX, took: took})
+	}
+
+	links, err := netlink.LinkList()
+	if err != nil {
+		return swaps, fmt.Errorf("list links: %w", err)
+	}
+	for _, l := range links {
+		filters, err := netlink.FilterList(l, filterParent(ingress))
+		if err != nil {
+			continue
+		}
+		for _, f := range filters {
+			bf, ok := f.(*netlink.BpfFilter)
+			if !ok || !isOurFilter(bf) {
+				continue
+			}
+			// 同 prio/handle 的 FilterReplace 在内核中原子替换程序
+			start := time.Now()
+			err := netlink.FilterReplace(bpfFilter(l.Attrs().Index, prog, ingress))
+			took := time.Since(start)
+			if err != nil {
+				return swaps, fmt.Errorf("replace filter on %s: %w", l.Attrs().Name, err)
+			}
+			swaps = append(swaps, swapResult{target: l.Attrs().Name, mode: attachModeTC, took: took})
+		}
+	}
+	return swaps, nil
+}
+
+// upgradeXDP 替换所有固定的 XDP link 中的程序
+func upgradeXDP(prog *ebpf.Program, pinDir string) ([]swapResult, error) {
+	var swaps []swapResult
+
+	entries, err := os.ReadDir(pinDir)
+	if err != nil {
+		return nil, err
+	}
+	for _, e := range entries {
+		if !strings.HasPrefix(e.Name(), xdpPinPrefix) {
+			continue
+		}
+		ifindex, err := strconv.Atoi(strings.TrimPrefix(e.Name(), xdpPinPrefix))
+		if err != nil {
+			continue
+		}
+		l := adoptXDP(filepath.Join(pinDir, e.Name()), ifindex)
+		if l == nil {
+			continue
+		}
+		start := time.Now()
+		err = l.Update(prog)
+		took := time.Since(start)
+		l.Close()
+		if err != nil {
+			return swaps, fmt.Errorf("update xdp link on ifindex %d: %w", ifindex, err)
+		}
+		swaps = append(swaps, swapResult{target: linkName(ifindex), mode: attachModeXDP, took: took})
+	}
+	return swaps, nil
+}
+
+// isOurFilter 判断 filter 是否是 attachNetlink 创建的
+func isOurFilter(f *netlink.BpfFilter) bool {
+	return f.Attrs().Priority == filterPrio && f.Attrs().Handle == netlink.MakeHandle(0, filterHandle) &&
+		strings.HasPrefix(f.Name, filterName)
+}
+
+// checkCgroupPin 确认 pinDir/pinName 固定的 cgroup link 以 typ 挂在 cgroup 上，没有固定的 link 时不做检查。
+// 挂在其他 cgroup 上时 (守护进程用了不同的 -cgroup) 无法原地替换，先卸载再挂载又会留下没有程序的窗口，
+// 只能报错，由运维改用守护进程的 -cgroup，或者用新的 -cgroup 重启守护进程
+func checkCgroupPin(typ ebpf.AttachType, pinDir, pinName, cgroup string) error {
+	pin := filepath.Join(pinDir, pinName)
+	if _, err := os.Stat(pin); errors.Is(err, os.ErrNotExist) {
+		return nil
+	}
+	l := adoptCgroup(pin, cgroup, typ)
+	if l == nil {
+		return fmt.Errorf("pinned link %s is not attached to cgroup %s; pass the running daemon's -cgroup, or restart the daemon to move it", pinName, cgroup)
+	}
+	return l.Close()
+}
+
+// upgradeCgroup 替换 pinDir/pinName 固定的 cgroup link 中的程序，没有固定的 link 时什么也不做。
+// 调用方先用 checkCgroupPin 确认 link 挂在 cgroup 上
+func upgradeCgroup(prog *ebpf.Program, typ ebpf.AttachType, pinDir, pinName, cgroup string) ([]swapResult, error) {
+	pin := filepath.Join(pinDir, pinName)
+	if _, err := os.Stat(pin); errors.Is(err, os.ErrNotExist) {
+		return nil, nil
+	}
+
+	l := adoptCgroup(pin, cgroup, typ)
+	if l == nil {
+		return nil, fmt.Errorf("pinned link %s is not attached to cgroup %s", pinName, cgroup)
+	}
+	defer l.Close()
+
+	start := time.Now()
+	if err := l.Update(prog); err != nil {
+		return nil, fmt.Errorf("update cgroup link %s: %w", pinName, err)
+	}
+	return []swapResult{{target: cgroup, mode: attachModeCgroup, took: time.Since(start)}}, nil
+}
+
+func linkName(ifindex int) string {
+	if l, err := netlink.LinkByIndex(ifindex); err == nil {
+		return l.Attrs().Name
+	}
+	return fmt.Sprintf("ifindex %d", ifindex)
+}
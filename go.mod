@@ -2,6 +2,8 @@ module github.com/eunomia-bpf/cilium-ebpf-starter-template
 
 go 1.20
 
-require github.com/cilium/ebpf v0.10.0
-
-require golang.org/x/sys v0.2.0 // indirect
+require (
+	github.com/cilium/ebpf v0.12.3
+	github.com/vishvananda/netlink v1.1.0
+	golang.org/x/sys v0.14.0
+)